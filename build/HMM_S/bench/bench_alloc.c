@@ -0,0 +1,592 @@
+/*
+ * Allocator benchmark harness.
+ *
+ * Runs one workload and prints a single line with its throughput, the latency
+ * percentiles of the individual malloc/free/realloc calls, the peak RSS of the process
+ * and its fragmentation ratio (memory the process gained divided by the most bytes
+ * the workload had allocated at once, 1.0 is a perfect allocator).
+ *
+ * Workloads:
+ *   churn            malloc/free of random sizes on a fixed number of slots
+ *   fifo             allocate a batch of small blocks, free them in allocation order
+ *   lifo             allocate a batch of small blocks, free them in reverse order
+ *   realloc          grow a few interleaved buffers with realloc
+ *   pingpong         threads allocate blocks that the next thread frees
+ *   replay FILE      replay a recorded allocation trace
+ *
+ * A trace has one call per line, blocks are named by a number below MAX_TRACE_IDS:
+ *   m ID SIZE        ID = malloc(SIZE)
+ *   c ID SIZE        ID = calloc(1, SIZE)
+ *   r ID SIZE        ID = realloc(ID, SIZE)
+ *   f ID             free(ID)
+ *
+ * It only calls the standard allocation functions, so it measures whatever allocator
+ * is in use:
+ *   gcc -O2 -pthread -o bench_alloc bench_alloc.c
+ *   ./bench_alloc churn                                  (system allocator)
+ *   LD_PRELOAD=../../BUILD/libhmm.so ./bench_alloc churn    (libhmm)
+ * run_bench.sh runs every workload with both allocators.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/* Number of calls made by the churn, fifo, lifo and pingpong workloads. */
+#define DEFAULT_OPS (2 * 1000 * 1000)
+
+/* Number of slots of the churn workload, about half of them hold a block. */
+#define CHURN_SLOTS (16 * 1024)
+
+/* Number of blocks freed at once by the fifo and lifo workloads. */
+#define BATCH_BLOCKS (64 * 1024)
+
+/* The realloc workload grows REALLOC_BUFFERS buffers up to REALLOC_MAX_SIZE bytes. */
+#define REALLOC_BUFFERS 8
+#define REALLOC_MAX_SIZE (8 * 1024 * 1024)
+
+/* Number of threads of the pingpong workload and blocks in flight between two of them. */
+#define PINGPONG_THREADS 4
+#define RING_SIZE 256
+
+/* Blocks of a trace are numbered from 0 to MAX_TRACE_IDS - 1. */
+#define MAX_TRACE_IDS (1024 * 1024)
+
+/*
+ * Latencies are counted in a histogram instead of being stored, so measuring them
+ * does not change the memory use of the process. Below 2^LATENCY_SUB_BITS ns every
+ * nanosecond has its own bucket, above that every power of two is split in
+ * 2^LATENCY_SUB_BITS buckets.
+ */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+
+/* One call of a trace. */
+struct trace_op {
+    char kind;      // 'm', 'c', 'r' or 'f'
+    unsigned int id;
+    size_t size;
+};
+
+/* Latency histogram of one thread. */
+struct latency {
+    unsigned long long count[LATENCY_BUCKETS];
+    unsigned long long total;
+};
+
+/* State of one thread of the pingpong workload. */
+struct pingpong_thread {
+    pthread_t thread;
+    void *ring[RING_SIZE];        // blocks sent by the previous thread
+    unsigned long head;           // next block to take, written by the owner
+    unsigned long tail;           // next free entry, written by the previous thread
+    struct pingpong_thread *next; // thread that frees the blocks of this one
+    unsigned long ops;
+    unsigned int seed;
+    struct latency latency;
+};
+
+static struct latency main_latency;
+static size_t live_bytes;       // bytes currently allocated by the workload
+static size_t peak_live_bytes;  // most bytes allocated at once
+
+/*
+ * Returns the current time of the monotonic clock in nanoseconds.
+ */
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns the resident set size of the process in kilobytes.
+ */
+static long rss_kb(void) {
+    long size = 0;
+    long pages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+
+    if (file) {
+        if (fscanf(file, "%ld %ld", &size, &pages) != 2) {
+            pages = 0;
+        }
+        fclose(file);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Counts one call in a latency histogram.
+ *
+ * Parameters:
+ *  - latency: The histogram.
+ *  - ns: Duration of the call in nanoseconds.
+ *
+ * Returns:
+ *  - None
+ */
+static void latency_add(struct latency *latency, unsigned long long ns) {
+    unsigned int bucket;
+
+    if (ns < (1 << LATENCY_SUB_BITS)) {
+        bucket = ns;
+    }
+    else {
+        unsigned int lg = 63 - __builtin_clzll(ns);
+        bucket = ((lg - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+                 + ((ns >> (lg - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+    }
+    latency->count[bucket]++;
+    latency->total++;
+}
+
+/*
+ * Computes a percentile of a latency histogram.
+ *
+ * Parameters:
+ *  - latency: The histogram.
+ *  - fraction: The percentile, between 0 and 1.
+ *
+ * Returns:
+ *  - The lowest latency of the bucket that holds the percentile, in nanoseconds.
+ */
+static unsigned long long latency_percentile(const struct latency *latency, double fraction) {
+    unsigned long long wanted = (unsigned long long)(latency->total * fraction);
+    unsigned long long seen = 0;
+    unsigned int bucket;
+
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += latency->count[bucket];
+        if (seen > wanted) {
+            break;
+        }
+    }
+    if (bucket < (1 << LATENCY_SUB_BITS)) {
+        return bucket;
+    }
+    return (1ULL << ((bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1))
+           + ((unsigned long long)(bucket & ((1 << LATENCY_SUB_BITS) - 1))
+              << ((bucket >> LATENCY_SUB_BITS) - 1));
+}
+
+/*
+ * Records that the workload allocated or freed bytes, for the fragmentation ratio.
+ */
+static void live_add(size_t size) {
+    size_t live = __atomic_add_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_live_bytes, __ATOMIC_RELAXED);
+
+    while ((live > peak)
+           && !__atomic_compare_exchange_n(&peak_live_bytes, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void live_sub(size_t size) {
+    __atomic_sub_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns a random allocation size: mostly small objects, some medium buffers and
+ * a few blocks big enough to get a mapping of their own.
+ */
+static size_t random_size(unsigned int *seed) {
+    unsigned int pick = rand_r(seed) % 1000;
+
+    if (pick < 800) {
+        return 1 + rand_r(seed) % 256;
+    }
+    if (pick < 980) {
+        return 257 + rand_r(seed) % 4096;
+    }
+    if (pick < 998) {
+        return 4353 + rand_r(seed) % (64 * 1024);
+    }
+    return 128 * 1024 + rand_r(seed) % (512 * 1024);
+}
+
+/*
+ * Timed wrappers of the allocation functions. malloc and calloc write the whole new
+ * block and realloc the part it grew by, like a program would, outside of the timed
+ * part, so the peak RSS counts the pages of every live byte.
+ */
+static void *timed_malloc(struct latency *latency, size_t size) {
+    unsigned long long start = now_ns();
+    char *ptr = malloc(size);
+    latency_add(latency, now_ns() - start);
+    if (ptr) {
+        memset(ptr, 1, size);
+        live_add(size);
+    }
+    return ptr;
+}
+
+static void *timed_calloc(struct latency *latency, size_t size) {
+    unsigned long long start = now_ns();
+    char *ptr = calloc(1, size);
+    latency_add(latency, now_ns() - start);
+    if (ptr) {
+        memset(ptr, 1, size);
+        live_add(size);
+    }
+    return ptr;
+}
+
+static void *timed_realloc(struct latency *latency, void *ptr, size_t old_size, size_t size) {
+    unsigned long long start = now_ns();
+    char *new_ptr = realloc(ptr, size);
+    latency_add(latency, now_ns() - start);
+    if (new_ptr) {
+        if (size > old_size) {
+            memset(new_ptr + old_size, 1, size - old_size);
+        }
+        live_sub(old_size);
+        live_add(size);
+    }
+    return new_ptr;
+}
+
+static void timed_free(struct latency *latency, void *ptr, size_t size) {
+    unsigned long long start = now_ns();
+    free(ptr);
+    latency_add(latency, now_ns() - start);
+    live_sub(size);
+}
+
+/*
+ * Frees and allocates blocks of random sizes on random slots.
+ *
+ * Parameters:
+ *  - ops: Number of calls to make.
+ *
+ * Returns:
+ *  - Number of calls made.
+ */
+static unsigned long run_churn(unsigned long ops) {
+    static void *slots[CHURN_SLOTS];
+    static size_t sizes[CHURN_SLOTS];
+    unsigned int seed = 1;
+    unsigned long i;
+    unsigned int slot;
+
+    for (i = 0; i < ops; i++) {
+        slot = rand_r(&seed) % CHURN_SLOTS;
+        if (slots[slot]) {
+            timed_free(&main_latency, slots[slot], sizes[slot]);
+            slots[slot] = NULL;
+        }
+        else {
+            sizes[slot] = random_size(&seed);
+            slots[slot] = timed_malloc(&main_latency, sizes[slot]);
+        }
+    }
+    for (slot = 0; slot < CHURN_SLOTS; slot++) {
+        if (slots[slot]) {
+            timed_free(&main_latency, slots[slot], sizes[slot]);
+            i++;
+        }
+    }
+    return i;
+}
+
+/*
+ * Allocates batches of small blocks and frees every batch at once.
+ *
+ * Parameters:
+ *  - ops: Number of calls to make, rounded up to whole batches.
+ *  - reverse: Free the blocks in the opposite order of their allocation when not 0.
+ *
+ * Returns:
+ *  - Number of calls made.
+ */
+static unsigned long run_batch(unsigned long ops, int reverse) {
+    static void *blocks[BATCH_BLOCKS];
+    static size_t sizes[BATCH_BLOCKS];
+    unsigned int seed = 1;
+    unsigned long done = 0;
+    unsigned int i;
+
+    while (done < ops) {
+        for (i = 0; i < BATCH_BLOCKS; i++) {
+            sizes[i] = 8 + rand_r(&seed) % 256;
+            blocks[i] = timed_malloc(&main_latency, sizes[i]);
+        }
+        for (i = 0; i < BATCH_BLOCKS; i++) {
+            unsigned int index = reverse ? BATCH_BLOCKS - 1 - i : i;
+            timed_free(&main_latency, blocks[index], sizes[index]);
+        }
+        done += 2 * BATCH_BLOCKS;
+    }
+    return done;
+}
+
+/*
+ * Grows a few buffers in turn with realloc, by half of their size every time,
+ * writing the new part of every buffer like a stream would.
+ *
+ * Parameters: None
+ *
+ * Returns:
+ *  - Number of calls made.
+ */
+static unsigned long run_realloc(void) {
+    char *buffers[REALLOC_BUFFERS] = { NULL };
+    size_t sizes[REALLOC_BUFFERS] = { 0 };
+    unsigned long done = 0;
+    size_t size;
+    unsigned int i;
+
+    for (size = 16; size <= REALLOC_MAX_SIZE; size += size / 2) {
+        for (i = 0; i < REALLOC_BUFFERS; i++) {
+            char *ptr = timed_realloc(&main_latency, buffers[i], sizes[i], size);
+            if (NULL == ptr) {
+                fprintf(stderr, "realloc of %zu bytes failed\n", size);
+                exit(1);
+            }
+            buffers[i] = ptr;
+            sizes[i] = size;
+            done++;
+        }
+    }
+    for (i = 0; i < REALLOC_BUFFERS; i++) {
+        timed_free(&main_latency, buffers[i], sizes[i]);
+        done++;
+    }
+    return done;
+}
+
+/*
+ * Body of a pingpong thread: it sends the blocks it allocates to the next thread and
+ * frees the blocks the previous thread sent, so nearly every free is a remote one.
+ */
+static void *pingpong_thread(void *arg) {
+    struct pingpong_thread *self = arg;
+    struct pingpong_thread *next = self->next;
+    unsigned long sent = 0;
+    unsigned long received = 0;
+    unsigned long tail;
+    unsigned long calls = self->ops / 2;
+    void *ptr;
+
+    while ((sent < calls) || (received < calls)) {
+        int progress = 0;
+        tail = __atomic_load_n(&next->tail, __ATOMIC_RELAXED);
+        if ((sent < calls) && (tail - __atomic_load_n(&next->head, __ATOMIC_ACQUIRE) < RING_SIZE)) {
+            // The size is stored in the block so the receiver knows it
+            size_t size = 16 + rand_r(&self->seed) % 512;
+            ptr = timed_malloc(&self->latency, size);
+            *(size_t *)ptr = size;
+            next->ring[tail % RING_SIZE] = ptr;
+            __atomic_store_n(&next->tail, tail + 1, __ATOMIC_RELEASE);
+            sent++;
+            progress = 1;
+        }
+        if (self->head != __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE)) {
+            ptr = self->ring[self->head % RING_SIZE];
+            __atomic_store_n(&self->head, self->head + 1, __ATOMIC_RELEASE);
+            timed_free(&self->latency, ptr, *(size_t *)ptr);
+            received++;
+            progress = 1;
+        }
+        if (!progress) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Runs PINGPONG_THREADS threads in a ring, every thread frees the blocks of the previous one.
+ *
+ * Parameters:
+ *  - ops: Number of calls every thread makes.
+ *
+ * Returns:
+ *  - Number of calls made by all the threads.
+ */
+static unsigned long run_pingpong(unsigned long ops) {
+    static struct pingpong_thread threads[PINGPONG_THREADS];
+    unsigned int i;
+    unsigned int bucket;
+
+    for (i = 0; i < PINGPONG_THREADS; i++) {
+        threads[i].next = &threads[(i + 1) % PINGPONG_THREADS];
+        threads[i].ops = ops;
+        threads[i].seed = i + 1;
+    }
+    for (i = 0; i < PINGPONG_THREADS; i++) {
+        pthread_create(&threads[i].thread, NULL, pingpong_thread, &threads[i]);
+    }
+    for (i = 0; i < PINGPONG_THREADS; i++) {
+        pthread_join(threads[i].thread, NULL);
+        for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            main_latency.count[bucket] += threads[i].latency.count[bucket];
+        }
+        main_latency.total += threads[i].latency.total;
+    }
+    return main_latency.total;
+}
+
+/*
+ * Reads a trace file.
+ *
+ * Parameters:
+ *  - path: The trace file.
+ *  - count: Set to the number of calls of the trace.
+ *
+ * Returns:
+ *  - The calls of the trace, the program exits when the file can not be read.
+ */
+static struct trace_op *trace_load(const char *path, unsigned long *count) {
+    FILE *file = fopen(path, "r");
+    struct trace_op *trace = NULL;
+    unsigned long capacity = 0;
+    char line[128];
+
+    if (NULL == file) {
+        perror(path);
+        exit(1);
+    }
+    *count = 0;
+    while (fgets(line, sizeof(line), file)) {
+        struct trace_op op = { 0 };
+        if (('#' == line[0]) || ('\n' == line[0])) {
+            continue;
+        }
+        if ((sscanf(line, "%c %u %zu", &op.kind, &op.id, &op.size) < 2) || (op.id >= MAX_TRACE_IDS)) {
+            fprintf(stderr, "%s: bad line: %s", path, line);
+            exit(1);
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            trace = realloc(trace, capacity * sizeof(*trace));
+            if (NULL == trace) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        trace[(*count)++] = op;
+    }
+    fclose(file);
+    return trace;
+}
+
+/*
+ * Replays the calls of a trace, blocks still allocated at its end are freed.
+ *
+ * Parameters:
+ *  - trace: The calls of the trace.
+ *  - count: Number of calls.
+ *
+ * Returns:
+ *  - Number of calls made.
+ */
+static unsigned long run_replay(const struct trace_op *trace, unsigned long count) {
+    static void *blocks[MAX_TRACE_IDS];
+    static size_t sizes[MAX_TRACE_IDS];
+    unsigned long done = 0;
+    unsigned long i;
+
+    for (i = 0; i < count; i++) {
+        unsigned int id = trace[i].id;
+        switch (trace[i].kind) {
+        case 'm':
+        case 'c':
+            if (blocks[id]) {
+                timed_free(&main_latency, blocks[id], sizes[id]);
+                done++;
+            }
+            sizes[id] = trace[i].size;
+            blocks[id] = ('m' == trace[i].kind) ? timed_malloc(&main_latency, sizes[id])
+                                                : timed_calloc(&main_latency, sizes[id]);
+            break;
+        case 'r':
+            blocks[id] = timed_realloc(&main_latency, blocks[id], sizes[id], trace[i].size);
+            sizes[id] = trace[i].size;
+            break;
+        case 'f':
+            if (NULL == blocks[id]) {
+                continue;
+            }
+            timed_free(&main_latency, blocks[id], sizes[id]);
+            blocks[id] = NULL;
+            break;
+        default:
+            continue;
+        }
+        done++;
+    }
+    for (i = 0; i < MAX_TRACE_IDS; i++) {
+        if (blocks[i]) {
+            timed_free(&main_latency, blocks[i], sizes[i]);
+            done++;
+        }
+    }
+    return done;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s churn|fifo|lifo|realloc|pingpong [OPS]\n"
+                    "       %s replay TRACE\n", name, name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    unsigned long ops = DEFAULT_OPS;
+    unsigned long done;
+    struct trace_op *trace = NULL;
+    unsigned long trace_count = 0;
+    const char *workload;
+    unsigned long long start;
+    double elapsed;
+    long start_rss;
+    struct rusage usage_info;
+    double peak_rss_kb;
+
+    if (argc < 2) {
+        usage(argv[0]);
+    }
+    workload = argv[1];
+    if (0 == strcmp(workload, "replay")) {
+        if (argc < 3) {
+            usage(argv[0]);
+        }
+        trace = trace_load(argv[2], &trace_count);
+    }
+    else if (argc > 2) {
+        ops = strtoul(argv[2], NULL, 0);
+    }
+
+    start_rss = rss_kb();
+    start = now_ns();
+    if (0 == strcmp(workload, "churn")) {
+        done = run_churn(ops);
+    } else if (0 == strcmp(workload, "fifo")) {
+        done = run_batch(ops, 0);
+    } else if (0 == strcmp(workload, "lifo")) {
+        done = run_batch(ops, 1);
+    } else if (0 == strcmp(workload, "realloc")) {
+        done = run_realloc();
+    } else if (0 == strcmp(workload, "pingpong")) {
+        done = run_pingpong(ops);
+    } else if (0 == strcmp(workload, "replay")) {
+        done = run_replay(trace, trace_count);
+    } else {
+        usage(argv[0]);
+        return 2;
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    getrusage(RUSAGE_SELF, &usage_info);
+    peak_rss_kb = usage_info.ru_maxrss;
+    printf("%-10s %12.0f %8llu %8llu %8llu %12.0f %8.2f\n", workload, done / elapsed,
+           latency_percentile(&main_latency, 0.50), latency_percentile(&main_latency, 0.99),
+           latency_percentile(&main_latency, 0.999), peak_rss_kb,
+           peak_live_bytes ? (peak_rss_kb - start_rss) * 1024 / peak_live_bytes : 0.0);
+    free(trace);
+    return 0;
+}
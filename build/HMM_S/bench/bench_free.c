@@ -0,0 +1,76 @@
+/*
+ * Free throughput benchmark.
+ *
+ * For a growing number of live blocks this program allocates that many blocks of
+ * random sizes and then frees all of them, timing only the frees. An allocator
+ * that walks the heap on every free gets slower as the number of live blocks grows,
+ * one that merges with the neighbours of the freed block stays flat.
+ *
+ * It only calls malloc and free, so it measures whatever allocator is in use:
+ *   gcc -O2 -o bench_free bench_free.c
+ *   ./bench_free                                  (system allocator)
+ *   LD_PRELOAD=../../BUILD/libhmm.so ./bench_free    (libhmm)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Largest number of live blocks measured, the count doubles from 1024 up to it. */
+#define MAX_LIVE_BLOCKS (64 * 1024)
+
+/*
+ * Blocks get a random size in [MIN_BLOCK_SIZE, MAX_BLOCK_SIZE] bytes. The sizes are above
+ * SLAB_MAX_SIZE of libhmm, so its frees go through the merge of heap blocks instead of
+ * the slab pages.
+ */
+#define MIN_BLOCK_SIZE 300
+#define MAX_BLOCK_SIZE 4096
+
+static void *blocks[MAX_LIVE_BLOCKS];
+
+/*
+ * Returns the current time of the monotonic clock in seconds.
+ */
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Frees 'count' live blocks and returns the number of frees per second.
+ *
+ * Parameters:
+ *  - count: Number of blocks to allocate and then free.
+ *  - reverse: Free the blocks in the opposite order of their allocation when not 0.
+ *
+ * Returns:
+ *  - Frees per second.
+ */
+static double free_rate(int count, int reverse) {
+    double start, elapsed;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        blocks[i] = malloc(MIN_BLOCK_SIZE + rand() % (MAX_BLOCK_SIZE - MIN_BLOCK_SIZE + 1));
+    }
+    start = now_seconds();
+    for (i = 0; i < count; i++) {
+        free(blocks[reverse ? count - 1 - i : i]);
+    }
+    elapsed = now_seconds() - start;
+    return count / elapsed;
+}
+
+int main(void) {
+    int count;
+
+    srand(1);
+    printf("%12s %16s %16s\n", "live blocks", "FIFO frees/s", "LIFO frees/s");
+    for (count = 1024; count <= MAX_LIVE_BLOCKS; count *= 2) {
+        double fifo = free_rate(count, 0);
+        double lifo = free_rate(count, 1);
+        printf("%12d %16.0f %16.0f\n", count, fifo, lifo);
+    }
+    return 0;
+}
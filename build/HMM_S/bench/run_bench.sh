@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Runs every workload of bench_alloc with the system allocator and with libhmm.
+#
+# usage: run_bench.sh [LIBHMM] [OPS]
+#   LIBHMM  libhmm.so to preload, ../../BUILD/libhmm.so by default
+#   OPS     number of calls of the churn, fifo, lifo and pingpong workloads
+#
+# bench_alloc is taken from $BENCH_ALLOC, or next to this script when it is not set.
+# Traces to replay are read from traces/*.trace.
+
+BENCH_ALLOC=$(realpath "${BENCH_ALLOC:-$(dirname "$0")/bench_alloc}")
+cd "$(dirname "$0")" || exit 1
+LIBHMM=$(realpath "${1:-../../BUILD/libhmm.so}")
+OPS=$2
+
+if [ ! -x "$BENCH_ALLOC" ]; then
+	echo "bench_alloc is not built" >&2
+	exit 1
+fi
+if [ ! -f "$LIBHMM" ]; then
+	echo "$LIBHMM not found" >&2
+	exit 1
+fi
+
+run () {
+	# $1 is the allocator name, the remaining arguments are passed to bench_alloc
+	name=$1
+	shift
+	printf '%-8s ' "$name"
+	if [ "$name" = libhmm ]; then
+		LD_PRELOAD=$LIBHMM "$BENCH_ALLOC" "$@"
+	else
+		"$BENCH_ALLOC" "$@"
+	fi
+}
+
+printf '%-8s %-10s %12s %8s %8s %8s %12s %8s\n' allocator workload "ops/s" p50_ns p99_ns p999_ns peak_rss_kb frag
+for workload in churn fifo lifo realloc pingpong; do
+	run system $workload $OPS
+	run libhmm $workload $OPS
+done
+for trace in traces/*.trace; do
+	[ -f "$trace" ] || continue
+	echo "# $trace"
+	run system replay "$trace"
+	run libhmm replay "$trace"
+done
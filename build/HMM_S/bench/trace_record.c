@@ -0,0 +1,284 @@
+/*
+ * Allocation trace recorder for bench_alloc.
+ *
+ * Preloaded in a program, it forwards malloc, calloc, realloc and free to the glibc
+ * allocator and writes every call to the file named by HMM_TRACE in the format that
+ * "bench_alloc replay" reads. The numbers of freed blocks are given to new blocks, so
+ * the numbers of a trace stay below the number of blocks the program had at once.
+ *
+ *   gcc -O2 -fPIC -shared -o trace_record.so trace_record.c
+ *   HMM_TRACE=traces/prog.trace LD_PRELOAD=./trace_record.so prog
+ *
+ * Calls made by other threads are recorded in the order they take the recorder lock.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Most blocks that can be allocated at once, it matches MAX_TRACE_IDS of bench_alloc. */
+#define MAX_IDS (1024 * 1024)
+
+/* Number of entries of the table from block address to block number, a power of two. */
+#define TABLE_SIZE (2 * MAX_IDS)
+
+/* Size of the buffer the trace is written from. */
+#define OUTPUT_SIZE (64 * 1024)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+/* Entry of the table from block address to block number. */
+struct table_entry {
+    void *ptr;        // NULL for an empty entry
+    unsigned int id;
+};
+
+static struct table_entry table[TABLE_SIZE];
+static unsigned int free_ids[MAX_IDS];  // numbers given back by free, the last one on top
+static unsigned int free_id_count;
+static unsigned int next_id;            // lowest number never used
+static char output[OUTPUT_SIZE];
+static size_t output_used;
+static int trace_fd = -1;               // -1 until the first call, -2 when tracing is off
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t table_slot(const void *ptr) {
+    uintptr_t key = (uintptr_t)ptr;
+    key ^= key >> 17;
+    key *= 0x9e3779b97f4a7c15ULL;
+    return (key >> 20) & (TABLE_SIZE - 1);
+}
+
+/*
+ * Gives a new block a number and remembers it.
+ *
+ * Returns:
+ *  - The number of the block.
+ *  - MAX_IDS if too many blocks are allocated, the block is then not traced.
+ */
+static unsigned int table_add(void *ptr) {
+    size_t slot = table_slot(ptr);
+    unsigned int id;
+
+    if (free_id_count) {
+        id = free_ids[--free_id_count];
+    } else if (next_id < MAX_IDS) {
+        id = next_id++;
+    } else {
+        return MAX_IDS;
+    }
+    while (table[slot].ptr) {
+        slot = (slot + 1) & (TABLE_SIZE - 1);
+    }
+    table[slot].ptr = ptr;
+    table[slot].id = id;
+    return id;
+}
+
+/*
+ * Forgets a block and gives its number back.
+ *
+ * Returns:
+ *  - The number of the block.
+ *  - MAX_IDS if the block is not known.
+ */
+static unsigned int table_remove(void *ptr) {
+    size_t slot = table_slot(ptr);
+    size_t hole;
+    size_t home;
+    unsigned int id;
+
+    while (table[slot].ptr != ptr) {
+        if (NULL == table[slot].ptr) {
+            return MAX_IDS;
+        }
+        slot = (slot + 1) & (TABLE_SIZE - 1);
+    }
+    id = table[slot].id;
+    // Move back the entries that probed past the removed one, linear probing has no tombstones
+    hole = slot;
+    while (1) {
+        slot = (slot + 1) & (TABLE_SIZE - 1);
+        if (NULL == table[slot].ptr) {
+            break;
+        }
+        home = table_slot(table[slot].ptr);
+        if (((slot - home) & (TABLE_SIZE - 1)) >= ((slot - hole) & (TABLE_SIZE - 1))) {
+            table[hole] = table[slot];
+            hole = slot;
+        }
+    }
+    table[hole].ptr = NULL;
+    free_ids[free_id_count++] = id;
+    return id;
+}
+
+static void output_flush(void) {
+    size_t done = 0;
+    ssize_t written;
+
+    while (done < output_used) {
+        written = write(trace_fd, output + done, output_used - done);
+        if (written <= 0) {
+            break;
+        }
+        done += written;
+    }
+    output_used = 0;
+}
+
+/*
+ * Writes one call of the trace, without calling any function that may allocate.
+ *
+ * Parameters:
+ *  - kind: 'm', 'c', 'r' or 'f'.
+ *  - id: Number of the block.
+ *  - size: Size of the call, not written for 'f'.
+ *
+ * Returns:
+ *  - None
+ */
+static void output_call(char kind, unsigned int id, size_t size) {
+    char line[48];
+    char digits[24];
+    size_t length = 0;
+    int count;
+
+    line[length++] = kind;
+    line[length++] = ' ';
+    count = 0;
+    do {
+        digits[count++] = '0' + id % 10;
+        id /= 10;
+    } while (id);
+    while (count) {
+        line[length++] = digits[--count];
+    }
+    if (kind != 'f') {
+        line[length++] = ' ';
+        do {
+            digits[count++] = '0' + size % 10;
+            size /= 10;
+        } while (size);
+        while (count) {
+            line[length++] = digits[--count];
+        }
+    }
+    line[length++] = '\n';
+    if (output_used + length > OUTPUT_SIZE) {
+        output_flush();
+    }
+    memcpy(output + output_used, line, length);
+    output_used += length;
+}
+
+/*
+ * Takes the recorder lock, opening the trace file on the first call.
+ *
+ * Returns:
+ *  - 1 if the call must be recorded, the lock is then held.
+ *  - 0 if tracing is off.
+ */
+static int trace_begin(void) {
+    const char *path;
+
+    if (-2 == trace_fd) {
+        return 0;
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (-1 == trace_fd) {
+        path = getenv("HMM_TRACE");
+        trace_fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+        if (trace_fd < 0) {
+            trace_fd = -2;
+            pthread_mutex_unlock(&trace_lock);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void trace_end(void) {
+    pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((destructor)) static void trace_close(void) {
+    if (trace_fd >= 0) {
+        pthread_mutex_lock(&trace_lock);
+        output_flush();
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    unsigned int id;
+
+    if (ptr && trace_begin()) {
+        id = table_add(ptr);
+        if (id < MAX_IDS) {
+            output_call('m', id, size);
+        }
+        trace_end();
+    }
+    return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *ptr = __libc_calloc(nmemb, size);
+    unsigned int id;
+
+    if (ptr && trace_begin()) {
+        id = table_add(ptr);
+        if (id < MAX_IDS) {
+            output_call('c', id, nmemb * size);
+        }
+        trace_end();
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *new_ptr;
+    unsigned int id;
+
+    if (NULL == ptr) {
+        return malloc(size);
+    }
+    if (0 == size) {
+        free(ptr);
+        return NULL;
+    }
+    if (!trace_begin()) {
+        return __libc_realloc(ptr, size);
+    }
+    // The lock is held so no other thread gets the old address before it is forgotten
+    new_ptr = __libc_realloc(ptr, size);
+    if (new_ptr) {
+        id = table_remove(ptr);
+        // The block keeps its number, it is the last one given back
+        if ((id < MAX_IDS) && (table_add(new_ptr) == id)) {
+            output_call('r', id, size);
+        }
+    }
+    trace_end();
+    return new_ptr;
+}
+
+void free(void *ptr) {
+    unsigned int id;
+
+    if (ptr && trace_begin()) {
+        id = table_remove(ptr);
+        if (id < MAX_IDS) {
+            output_call('f', id, 0);
+        }
+        trace_end();
+    }
+    __libc_free(ptr);
+}
@@ -20,151 +20,1610 @@ void *realloc(void *ptr, size_t size)
 {
 	return my_realloc(ptr , size);
 }
+
+int mallopt(int param, int value)
+{
+	return my_mallopt(param , value);
+}
+
+void malloc_stats(void)
+{
+	my_malloc_stats();
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	// Like glibc, round an alignment that is not a power of two up to the next one
+	if (alignment & (alignment - 1)) {
+		alignment = (alignment > (SIZE_MAX >> 1)) ? (SIZE_MAX >> 1) + 1 : (size_t)1 << (64 - __builtin_clzll(alignment));
+	}
+	return my_memalign(alignment , size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *ptr;
+
+	if ((alignment % sizeof(void *)) || (alignment & (alignment - 1)) || (0 == alignment)) {
+		return EINVAL;
+	}
+	ptr = my_memalign(alignment , size);
+	if (NULL == ptr) {
+		return ENOMEM;
+	}
+	*memptr = ptr;
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return my_memalign(alignment , size);
+}
+
+void *valloc(size_t size)
+{
+	return my_memalign(sysconf(_SC_PAGESIZE) , size);
+}
+
+void *pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (size > PTRDIFF_MAX) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return my_memalign(page , size ? ALIGN_UP(size, page) : page);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	return my_malloc_usable_size(ptr);
+}
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+struct mallinfo2 mallinfo2(void)
+{
+	struct hmm_stats stats;
+	struct mallinfo2 info = { 0 };
+
+	hmm_stats(&stats);
+	info.arena = stats.bytes_mapped - stats.mmapped_bytes;
+	info.hblks = stats.mmapped_blocks;
+	info.hblkhd = stats.mmapped_bytes;
+	info.uordblks = stats.bytes_in_use - stats.mmapped_bytes;
+	info.fordblks = info.arena - info.uordblks;
+	return info;
+}
 #endif
-void *ProgBreak; //to record the current adress of the program break
-struct meta_data *free_list = NULL;  // this pointer points to the start of the free list
-unsigned char num_block=0;    //i used this global variable to record number of allocated blocks
+#endif
+static unsigned int num_block=0;    //i used this global variable to record number of mapped heap chunks
+static size_t page_size = PAGE_SIZE; // page size of the system, read by init_fun
+static size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD; // requests of this size or more get a mapping of their own
+
+// The arenas, only the first num_arenas of them are handed to threads
+static struct arena arenas[MAX_ARENAS] = { [0 ... MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } };
+static unsigned int num_arenas = 0;       // number of arenas in use, 0 until init_fun has run
+static unsigned int next_arena = 0;       // counts the threads that got an arena, for the round-robin
+static char init_started = 0;             // set by the first thread that runs init_fun
+static char fork_handlers_registered = 0; // set once the pthread_atfork handlers are installed
+
+// The address range of the slab pages, empty until init_fun reserves it
+static uintptr_t slab_base = 0;
+static size_t slab_size = 0;
+static char *slab_top = NULL;                // start of the slab pages that were never used
+static char *slab_committed = NULL;          // end of the writable part of the range
+static struct slab *slab_free_pages = NULL;  // emptied slab pages, chained through next_slab
+static pthread_mutex_t slab_region_lock = PTHREAD_MUTEX_INITIALIZER; // protects the three above
+
+static size_t slab_free_page_count = 0;      // number of pages in slab_free_pages
+
+// Object size of every slab class
+static const unsigned int slab_sizes[SLAB_CLASSES] = { 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256 };
+
+// Counters that are not kept by the arenas, they are changed with relaxed atomic operations
+static unsigned long long mmap_calls = 0;
+static unsigned long long munmap_calls = 0;
+static unsigned long long mremap_calls = 0;
+static unsigned long long madvise_calls = 0;
+static unsigned long long mprotect_calls = 0;
+static unsigned long long double_frees = 0;
+static size_t mmapped_blocks = 0;            // blocks with a mapping of their own
+static size_t mmapped_bytes = 0;             // payload bytes of those blocks
+
+// The heap profiler, prof_rate is 0 when it is off
+static size_t prof_rate = 0;                         // mean number of bytes allocated between two samples
+static const char *prof_file = "hmm_prof";           // the profile is written to prof_file.<pid>
+static struct prof_sample *prof_table[PROF_TABLE_SIZE]; // the live samples, by address
+static struct prof_sample *prof_free_samples = NULL; // samples that can be reused
+static size_t prof_sample_count = 0;                 // samples ever created, bounds the walks of prof_table
+static size_t prof_live_samples = 0;                 // samples that are in prof_table
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER; // protects the samples except for hmm_prof_dump
+static __thread size_t prof_bytes_left __attribute__((tls_model("initial-exec"))) = 0; // bytes until the next sample
+static __thread unsigned long long prof_random __attribute__((tls_model("initial-exec"))) = 0;
+static __thread char prof_busy __attribute__((tls_model("initial-exec"))) = 0; // set while the thread takes a sample
+
+/* Values of tcache_state, the life cycle of the cache of one thread. */
+#define TCACHE_UNUSED 0
+#define TCACHE_STARTING 1
+#define TCACHE_READY 2
+#define TCACHE_STOPPED 3
+
+// The thread-local variables use the initial-exec model so reading them never calls malloc
+static __thread struct tcache *thread_cache __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread char tcache_state __attribute__((tls_model("initial-exec"))) = TCACHE_UNUSED;
+static __thread struct arena *thread_arena __attribute__((tls_model("initial-exec"))) = NULL;
+static pthread_key_t tcache_key;                          // runs tcache_destroy when a thread exits
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Wrappers of the memory calls to the OS that count them for hmm_stats.
+ */
+static void *os_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    __atomic_fetch_add(&mmap_calls, 1, __ATOMIC_RELAXED);
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+static int os_munmap(void *addr, size_t length) {
+    __atomic_fetch_add(&munmap_calls, 1, __ATOMIC_RELAXED);
+    return munmap(addr, length);
+}
+
+static void *os_mremap(void *addr, size_t old_length, size_t length, int flags) {
+    __atomic_fetch_add(&mremap_calls, 1, __ATOMIC_RELAXED);
+    return mremap(addr, old_length, length, flags);
+}
+
+static int os_madvise(void *addr, size_t length, int advice) {
+    __atomic_fetch_add(&madvise_calls, 1, __ATOMIC_RELAXED);
+    return madvise(addr, length, advice);
+}
+
+static int os_mprotect(void *addr, size_t length, int prot) {
+    __atomic_fetch_add(&mprotect_calls, 1, __ATOMIC_RELAXED);
+    return mprotect(addr, length, prot);
+}
+
+/*
+ * Computes the bin that holds free blocks of the given size.
+ *
+ * Sizes below SMALL_BIN_LIMIT map to their own exact bin (sizes are multiples of 8).
+ * Bigger sizes map to one of LARGE_BIN_SPLIT bins inside their power of two, the
+ * last bin collects everything that is too big for the others.
+ *
+ * Parameters:
+ *  - size: The payload size of the block.
+ *
+ * Returns:
+ *  - Index of the bin in bins[].
+ */
+static unsigned int bin_index(size_t size) {
+    if (size < SMALL_BIN_LIMIT) {
+        return size >> 3;
+    }
+    // Position of the highest set bit, it is at least 9 because SMALL_BIN_LIMIT is 512
+    unsigned int lg = 63 - __builtin_clzll(size);
+    unsigned int index = SMALL_BIN_COUNT + (lg - 9) * LARGE_BIN_SPLIT
+                         + ((size >> (lg - 2)) & (LARGE_BIN_SPLIT - 1));
+    if (index >= NUM_BINS) {
+        index = NUM_BINS - 1;
+    }
+    return index;
+}
+
+/*
+ * Pushes a free block at the head of its size bin and marks the bin as non-empty.
+ *
+ * Parameters:
+ *  - arena: The arena that owns the block.
+ *  - block: Pointer to the free block.
+ *
+ * Returns:
+ *  - None
+ */
+static void bin_insert(struct arena *arena, struct meta_data *block) {
+    unsigned int index = bin_index(block->size);
+    struct meta_data *head = arena->bins[index];
+
+    // Count the pages of a big free block that can be given back to the OS
+    if (!block->zeroed && (block->size >= RELEASE_THRESHOLD)) {
+        arena->dirty_bytes += block->size;
+    }
+    FREE_LINKS(block)->prev_free = NULL;
+    FREE_LINKS(block)->next_free = head;
+    if (head) {
+        FREE_LINKS(head)->prev_free = block;
+    }
+    arena->bins[index] = block;
+    arena->bin_map[index / 64] |= 1ULL << (index % 64);
+}
+
+/*
+ * Unlinks a free block from its size bin and clears the bin bit once the bin is empty.
+ * The block size and zeroed byte must not have changed since the block was inserted.
+ *
+ * Parameters:
+ *  - arena: The arena that owns the block.
+ *  - block: Pointer to the free block.
+ *
+ * Returns:
+ *  - None
+ */
+static void bin_remove(struct arena *arena, struct meta_data *block) {
+    unsigned int index = bin_index(block->size);
+    struct free_links *links = FREE_LINKS(block);
+
+    if (!block->zeroed && (block->size >= RELEASE_THRESHOLD)) {
+        arena->dirty_bytes -= block->size;
+        if (arena->dirty_bytes < arena->purge_floor) {
+            arena->purge_floor = arena->dirty_bytes;
+        }
+    }
+    if (links->prev_free) {
+        FREE_LINKS(links->prev_free)->next_free = links->next_free;
+    } else {
+        arena->bins[index] = links->next_free;
+    }
+    if (links->next_free) {
+        FREE_LINKS(links->next_free)->prev_free = links->prev_free;
+    }
+    if (NULL == arena->bins[index]) {
+        arena->bin_map[index / 64] &= ~(1ULL << (index % 64));
+    }
+}
+
+/*
+ * Finds the first non-empty bin starting from a given bin using the bin bitmap.
+ *
+ * Parameters:
+ *  - arena: The arena to search.
+ *  - index: The first bin to look at.
+ *
+ * Returns:
+ *  - Index of the first non-empty bin.
+ *  - NUM_BINS if all the remaining bins are empty.
+ */
+static unsigned int next_bin(struct arena *arena, unsigned int index) {
+    unsigned int word = index / 64;
+    unsigned long long bits;
+
+    if (index >= NUM_BINS) {
+        return NUM_BINS;
+    }
+    // Ignore the bins below 'index' in the first word
+    bits = arena->bin_map[word] & (~0ULL << (index % 64));
+    while (0 == bits) {
+        word++;
+        if (word == BINMAP_WORDS) {
+            return NUM_BINS;
+        }
+        bits = arena->bin_map[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+/*
+ * Takes a free block of at least the given size out of the bins of an arena.
+ *
+ * A small request is served from its exact bin. A large request looks through
+ * its own bin for a block that is big enough. If that fails, any block in the next
+ * non-empty bin is big enough, so only the head of that bin is taken.
+ *
+ * Parameters:
+ *  - arena: The arena to search.
+ *  - size: The size of memory requested for allocation.
+ *
+ * Returns:
+ *  - Pointer to the free block, unlinked from its bin.
+ *  - NULL if no free block is big enough.
+ */
+static struct meta_data *bin_take(struct arena *arena, size_t size) {
+    unsigned int index = bin_index(size);
+    struct meta_data *block = arena->bins[index];
+
+    // Blocks in a large bin have different sizes, look for one that fits
+    while (block && block->size < size) {
+        block = FREE_LINKS(block)->next_free;
+    }
+    if (NULL == block) {
+        index = next_bin(arena, index + 1);
+        if (index == NUM_BINS) {
+            return NULL;
+        }
+        block = arena->bins[index];
+    }
+    bin_remove(arena, block);
+    return block;
+}
+
+/*
+ * Tells whether a pointer is an object of a slab page.
+ *
+ * Parameters:
+ *  - ptr: The pointer returned by my_malloc.
+ *
+ * Returns:
+ *  - 1 if 'ptr' lies in the address range of the slab pages.
+ *  - 0 otherwise, also before the range is reserved.
+ */
+static inline int is_slab(const void *ptr) {
+    return ((uintptr_t)ptr - slab_base) < slab_size;
+}
+
+/*
+ * Computes the slab class of an allocation size.
+ *
+ * Parameters:
+ *  - size: The size requested, at most SLAB_MAX_SIZE.
+ *
+ * Returns:
+ *  - Index of the smallest class whose objects can hold 'size' bytes.
+ */
+static inline unsigned int slab_class(size_t size) {
+    if (size <= 128) {
+        return size ? (size - 1) >> 4 : 0;
+    }
+    return 8 + ((size - 129) >> 5);
+}
+
+/*
+ * Takes a slab page from the slab address range.
+ *
+ * Pages emptied earlier are reused first. Otherwise the next page that was never used
+ * is taken, making the range writable one SLAB_COMMIT_STEP further when needed.
+ *
+ * Parameters: None
+ *
+ * Returns:
+ *  - Pointer to the slab page, its header is not initialized.
+ *  - NULL if the range is used up or can not be made writable.
+ */
+static struct slab *slab_page_map(void) {
+    struct slab *slab;
+    size_t step;
+
+    pthread_mutex_lock(&slab_region_lock);
+    slab = slab_free_pages;
+    if (slab) {
+        slab_free_pages = slab->next_slab;
+        slab_free_page_count--;
+        pthread_mutex_unlock(&slab_region_lock);
+        return slab;
+    }
+    if (slab_top == (char *)(slab_base + slab_size)) {
+        pthread_mutex_unlock(&slab_region_lock);
+        return NULL;
+    }
+    if (slab_top == slab_committed) {
+        step = (char *)(slab_base + slab_size) - slab_committed;
+        if (step > SLAB_COMMIT_STEP) {
+            step = SLAB_COMMIT_STEP;
+        }
+        if (os_mprotect(slab_committed, step, PROT_READ | PROT_WRITE) != 0) {
+            pthread_mutex_unlock(&slab_region_lock);
+            return NULL;
+        }
+        slab_committed += step;
+    }
+    slab = (struct slab *)slab_top;
+    slab_top += SLAB_PAGE_SIZE;
+    pthread_mutex_unlock(&slab_region_lock);
+    return slab;
+}
+
+/*
+ * Gives an empty slab page back to the slab address range.
+ * Its pages are released to the OS, except the first one that holds the header and
+ * the link to the next emptied page.
+ *
+ * Parameters:
+ *  - slab: The slab page, it has no allocated object left.
+ *
+ * Returns:
+ *  - None
+ */
+static void slab_page_unmap(struct slab *slab) {
+    char *first = (char *)(((uintptr_t)slab + SLAB_HEADER_SIZE + page_size - 1) & ~((uintptr_t)page_size - 1));
+
+    if (first < (char *)slab + SLAB_PAGE_SIZE) {
+        os_madvise(first, (char *)slab + SLAB_PAGE_SIZE - first, MADV_DONTNEED);
+    }
+    pthread_mutex_lock(&slab_region_lock);
+    slab->next_slab = slab_free_pages;
+    slab_free_pages = slab;
+    slab_free_page_count++;
+    pthread_mutex_unlock(&slab_region_lock);
+}
+
+/*
+ * Pushes a slab page on the list of the slab pages of its class that have free objects.
+ *
+ * Parameters:
+ *  - slab: The slab page.
+ *
+ * Returns:
+ *  - None
+ */
+static void slab_link(struct slab *slab) {
+    struct slab **head = &slab->arena->slabs[slab->size_class];
+
+    slab->prev_slab = NULL;
+    slab->next_slab = *head;
+    if (*head) {
+        (*head)->prev_slab = slab;
+    }
+    *head = slab;
+}
+
+/*
+ * Unlinks a slab page from the list of the slab pages of its class that have free objects.
+ *
+ * Parameters:
+ *  - slab: The slab page.
+ *
+ * Returns:
+ *  - None
+ */
+static void slab_unlink(struct slab *slab) {
+    if (slab->prev_slab) {
+        slab->prev_slab->next_slab = slab->next_slab;
+    } else {
+        slab->arena->slabs[slab->size_class] = slab->next_slab;
+    }
+    if (slab->next_slab) {
+        slab->next_slab->prev_slab = slab->prev_slab;
+    }
+}
+
+/*
+ * Allocates an object of a slab class from an arena.
+ *
+ * The object is taken from the first slab page of the class that has a free object,
+ * its bitmap gives the first free object without looking at the objects themselves.
+ * When the class has no such page a new one is set up. The arena lock must be held.
+ *
+ * Parameters:
+ *  - arena: The arena to allocate from.
+ *  - index: The slab class.
+ *
+ * Returns:
+ *  - Pointer to the object.
+ *  - NULL if no slab page can be mapped.
+ */
+static void *slab_alloc(struct arena *arena, unsigned int index) {
+    struct slab *slab = arena->slabs[index];
+    unsigned long long free_bits;
+    unsigned int word;
+    unsigned int bit;
+
+    if (NULL == slab) {
+        slab = slab_page_map();
+        if (NULL == slab) {
+            return NULL;
+        }
+        slab->arena = arena;
+        slab->size_class = index;
+        slab->object_size = slab_sizes[index];
+        slab->capacity = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / slab->object_size;
+        slab->used = 0;
+        slab->free_word = 0;
+        // Mark the bits past the last object as used so they are never handed out
+        memset(slab->bitmap, 0, sizeof(slab->bitmap));
+        for (bit = slab->capacity; bit < SLAB_BITMAP_WORDS * 64; bit++) {
+            slab->bitmap[bit / 64] |= 1ULL << (bit % 64);
+        }
+        slab_link(slab);
+    }
+    word = slab->free_word;
+    while (0 == (free_bits = ~slab->bitmap[word])) {
+        word++;
+    }
+    bit = __builtin_ctzll(free_bits);
+    slab->bitmap[word] |= 1ULL << bit;
+    slab->free_word = word;
+    slab->used++;
+    arena->stats.slab_objects[index]++;
+    // A full slab page leaves the list until one of its objects is freed
+    if (slab->used == slab->capacity) {
+        slab_unlink(slab);
+    }
+    return (char *)slab + SLAB_HEADER_SIZE + (word * 64 + bit) * (size_t)slab->object_size;
+}
+
+/*
+ * Frees an object of a slab page into the arena that owns the page.
+ *
+ * A slab page that becomes empty is given back to the slab address range, unless it
+ * is the only page of its class with free objects. The arena lock must be held.
+ *
+ * Parameters:
+ *  - ptr: The slab object.
+ *
+ * Returns:
+ *  - None
+ */
+static void slab_free(void *ptr) {
+    struct slab *slab = SLAB_OF(ptr);
+    unsigned int object = ((char *)ptr - (char *)slab - SLAB_HEADER_SIZE) / slab->object_size;
+
+    slab->bitmap[object / 64] &= ~(1ULL << (object % 64));
+    slab->arena->stats.slab_objects[slab->size_class]--;
+    if (object / 64 < slab->free_word) {
+        slab->free_word = object / 64;
+    }
+    if (slab->used == slab->capacity) {
+        slab_link(slab);
+    }
+    slab->used--;
+    if ((0 == slab->used) && (slab->prev_slab || slab->next_slab)) {
+        slab_unlink(slab);
+        slab_page_unmap(slab);
+    }
+}
+
+/*
+ * Tells whether an object of a slab page is allocated according to the bitmap of its page.
+ * Objects held by a thread cache or waiting in a remote free list still count as allocated.
+ *
+ * Parameters:
+ *  - ptr: The slab object.
+ *
+ * Returns:
+ *  - Non-zero if the object is allocated.
+ *  - 0 if it was already given back to its slab page.
+ */
+static int slab_in_use(void *ptr) {
+    struct slab *slab = SLAB_OF(ptr);
+    unsigned int object = ((char *)ptr - (char *)slab - SLAB_HEADER_SIZE) / slab->object_size;
+
+    // The owner may be changing the word under its arena lock, any torn view is still valid for this bit
+    return (__atomic_load_n(&slab->bitmap[object / 64], __ATOMIC_RELAXED) >> (object % 64)) & 1;
+}
+
+/*
+ * Pushes a chain of freed memory on the remote free list of an arena without taking its lock.
+ *
+ * The chain links slab objects and payloads of blocks, flagged cachedBlock, through their
+ * first word from 'first' to 'last'. The next thread that takes the arena lock frees them.
+ *
+ * Parameters:
+ *  - arena: The arena that owns the memory.
+ *  - first: First pointer of the chain.
+ *  - last: Last pointer of the chain.
+ *
+ * Returns:
+ *  - None
+ */
+static void remote_free_push(struct arena *arena, void *first, void *last) {
+    void *head = __atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED);
+
+    do {
+        *(void **)last = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_free, &head, first, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Frees one slab object or block payload of a chain into the arena that owns it.
+ * The arena lock must be held.
+ *
+ * Parameters:
+ *  - ptr: The slab object, or the payload of a block flagged cachedBlock.
+ *
+ * Returns:
+ *  - None
+ */
+static void arena_free(void *ptr) {
+    struct meta_data *block;
+
+    if (is_slab(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+    block = ((struct meta_data *)ptr) - 1;
+    CHUNK_OF(block)->arena->stats.heap_bytes -= block->size;
+    block->flag = freeBlock;
+    block->zeroed = 0;
+    merge_(block);
+}
+
+/*
+ * Gives the memory of the remote free list of an arena back to its slab pages and heap.
+ * The arena lock must be held.
+ *
+ * Parameters:
+ *  - arena: The arena to drain.
+ *
+ * Returns:
+ *  - None
+ */
+static void remote_free_drain(struct arena *arena) {
+    void *ptr;
+    void *next;
+
+    if (NULL == __atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED)) {
+        return;
+    }
+    ptr = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (ptr) {
+        next = *(void **)ptr;
+        arena_free(ptr);
+        ptr = next;
+    }
+}
+
+/*
+ * Handlers that keep the arenas usable in the child of fork().
+ * Every arena lock, then the locks of the slab address range and of the heap profiler,
+ * are taken before forking so no other thread is changing a heap while it is copied, then the parent releases them
+ * and the child starts new ones.
+ */
+static void fork_prepare(void) {
+    unsigned int i;
+    for (i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&slab_region_lock);
+    pthread_mutex_lock(&prof_lock);
+}
+
+static void fork_parent(void) {
+    unsigned int i;
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&slab_region_lock);
+    for (i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+static void fork_child(void) {
+    unsigned int i;
+    pthread_mutex_init(&slab_region_lock, NULL);
+    pthread_mutex_init(&prof_lock, NULL);
+    for (i = 0; i < MAX_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    }
+}
+
+/*
+ * Returns the arena of the calling thread, handing one out on first use.
+ *
+ * Threads get the arenas round-robin, so the main thread gets the first one. A thread
+ * that allocates while init_fun is still running uses the first arena for that call.
+ *
+ * Parameters: None
+ *
+ * Returns:
+ *  - Pointer to the arena of the calling thread.
+ */
+static struct arena *arena_self(void) {
+    unsigned int count;
+
+    if (thread_arena) {
+        return thread_arena;
+    }
+    count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    if (0 == count) {
+        if (__atomic_exchange_n(&init_started, 1, __ATOMIC_ACQ_REL)) {
+            return &arenas[0];
+        }
+        init_fun();
+        count = num_arenas;
+    }
+    thread_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % count];
+    return thread_arena;
+}
+
+/*
+ * Takes the lock of an arena and frees the blocks that other threads left on its
+ * remote free list.
+ *
+ * Parameters:
+ *  - arena: The arena to lock.
+ *
+ * Returns:
+ *  - None
+ */
+static void arena_lock(struct arena *arena) {
+    pthread_mutex_lock(&arena->lock);
+    remote_free_drain(arena);
+}
+
+/*
+ * Releases the lock of an arena.
+ * The fork handlers are registered here, outside the lock, the first time because
+ * pthread_atfork may itself allocate memory.
+ *
+ * Parameters:
+ *  - arena: The arena to unlock.
+ *
+ * Returns:
+ *  - None
+ */
+static void arena_unlock(struct arena *arena) {
+    pthread_mutex_unlock(&arena->lock);
+    if (!__atomic_load_n(&fork_handlers_registered, __ATOMIC_RELAXED)
+        && !__atomic_exchange_n(&fork_handlers_registered, 1, __ATOMIC_ACQ_REL)) {
+        pthread_atfork(fork_prepare, fork_parent, fork_child);
+    }
+}
+
+/*
+ * Gives freed memory back to the arena that owns it.
+ *
+ * The slab objects and the payloads of blocks flagged cachedBlock are chained through
+ * their first word. If the arena lock is free they are freed right away, otherwise the
+ * whole chain is pushed on the remote free list of the arena so the caller never waits
+ * for the lock.
+ *
+ * Parameters:
+ *  - arena: The arena that owns all the memory of the chain.
+ *  - first: First pointer of the chain.
+ *  - last: Last pointer of the chain, its link is ignored.
+ *
+ * Returns:
+ *  - None
+ */
+static void arena_release_blocks(struct arena *arena, void *first, void *last) {
+    void *next;
+
+    if (pthread_mutex_trylock(&arena->lock) != 0) {
+        remote_free_push(arena, first, last);
+        return;
+    }
+    remote_free_drain(arena);
+    while (1) {
+        next = *(void **)first;
+        arena_free(first);
+        if (first == last) {
+            break;
+        }
+        first = next;
+    }
+    arena_unlock(arena);
+}
+
+/*
+ * Flushes the oldest objects of one size class of a thread cache back to their arenas.
+ * The objects are handed over in runs of consecutive objects of the same arena.
+ *
+ * Parameters:
+ *  - cache: The thread cache.
+ *  - index: The size class.
+ *  - keep: Number of objects that stay in the cache.
+ *
+ * Returns:
+ *  - None
+ */
+static void tcache_flush(struct tcache *cache, unsigned int index, unsigned int keep) {
+    void *first;
+    void *last;
+    void *next;
+    struct arena *arena;
+    unsigned int i;
+
+    if (cache->counts[index] <= keep) {
+        return;
+    }
+    // The most recently freed objects are at the head, keep those in the cache
+    if (0 == keep) {
+        first = cache->entries[index];
+        cache->entries[index] = NULL;
+    }
+    else {
+        void *kept = cache->entries[index];
+        for (i = 1; i < keep; i++) {
+            kept = *(void **)kept;
+        }
+        first = *(void **)kept;
+        *(void **)kept = NULL;
+    }
+    cache->counts[index] = keep;
+    while (first) {
+        arena = SLAB_OF(first)->arena;
+        last = first;
+        ((void **)last)[1] = NULL;
+        while (*(void **)last && (SLAB_OF(*(void **)last)->arena == arena)) {
+            last = *(void **)last;
+            ((void **)last)[1] = NULL;
+        }
+        next = *(void **)last;
+        arena_release_blocks(arena, first, last);
+        first = next;
+    }
+}
+
+/*
+ * Empties the cache of a thread that exits and gives the cache itself back to its arena.
+ * It is the destructor of tcache_key.
+ *
+ * Parameters:
+ *  - arg: The cache of the exiting thread.
+ *
+ * Returns:
+ *  - None
+ */
+static void tcache_destroy(void *arg) {
+    struct tcache *cache = arg;
+    struct meta_data *block = ((struct meta_data *)cache) - 1;
+    unsigned int i;
+
+    // Allocations made after this point, by other destructors, go to the arena
+    tcache_state = TCACHE_STOPPED;
+    thread_cache = NULL;
+    for (i = 0; i < TCACHE_CLASSES; i++) {
+        tcache_flush(cache, i, 0);
+    }
+    block->flag = cachedBlock;
+    arena_release_blocks(CHUNK_OF(block)->arena, cache, cache);
+}
+
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * Returns the cache of the calling thread, creating it on first use.
+ *
+ * The cache itself is a block of the arena of the thread. While it is being created,
+ * and after the thread started exiting, the calling thread has no cache and uses its
+ * arena directly.
+ *
+ * Parameters: None
+ *
+ * Returns:
+ *  - Pointer to the cache of the calling thread.
+ *  - NULL if the thread can not use a cache right now.
+ */
+static struct tcache *tcache_self(void) {
+    struct arena *arena;
+    struct meta_data *block;
+
+    if (thread_cache) {
+        return thread_cache;
+    }
+    if (tcache_state != TCACHE_UNUSED) {
+        return NULL;
+    }
+    tcache_state = TCACHE_STARTING;
+    pthread_once(&tcache_key_once, tcache_key_create);
+
+    arena = arena_self();
+    arena_lock(arena);
+    block = needed_block(arena, ALIGN_UP(sizeof(struct tcache), MALLOC_ALIGNMENT));
+    arena_unlock(arena);
+    if (NULL == block) {
+        tcache_state = TCACHE_UNUSED;
+        return NULL;
+    }
+    memset(block + 1, 0, sizeof(struct tcache));
+    // pthread_setspecific may allocate, such allocations see TCACHE_STARTING and use the arena
+    pthread_setspecific(tcache_key, block + 1);
+    thread_cache = (struct tcache *)(block + 1);
+    tcache_state = TCACHE_READY;
+    return thread_cache;
+}
+
+/*
+ * Allocates an object of a slab class from the cache of the calling thread.
+ *
+ * An empty size class is first refilled with up to TCACHE_BATCH objects taken from
+ * the slab pages of the arena of the thread under a single lock. A thread that has no
+ * cache takes a single object from its arena.
+ *
+ * Parameters:
+ *  - index: The slab class.
+ *
+ * Returns:
+ *  - Pointer to the allocated memory.
+ *  - NULL if the arena can not get a slab page.
+ */
+static void *tcache_get(unsigned int index) {
+    struct tcache *cache = tcache_self();
+    struct arena *arena;
+    void *ptr;
+    unsigned int i;
+
+    if ((NULL == cache) || (NULL == cache->entries[index])) {
+        arena = arena_self();
+        arena_lock(arena);
+        if (NULL == cache) {
+            ptr = slab_alloc(arena, index);
+            arena_unlock(arena);
+            return ptr;
+        }
+        for (i = 0; i < TCACHE_BATCH; i++) {
+            ptr = slab_alloc(arena, index);
+            if (NULL == ptr) {
+                break;
+            }
+            *(void **)ptr = cache->entries[index];
+            cache->entries[index] = ptr;
+        }
+        arena_unlock(arena);
+        cache->counts[index] = i;
+        if (0 == i) {
+            return NULL;
+        }
+    }
+    ptr = cache->entries[index];
+    cache->entries[index] = *(void **)ptr;
+    cache->counts[index]--;
+    ((void **)ptr)[1] = NULL;
+    return ptr;
+}
+
+/*
+ * Tells whether a slab object is in the cache of the calling thread.
+ * Only objects whose second word points to the cache are looked for in it.
+ *
+ * Parameters:
+ *  - ptr: The slab object.
+ *
+ * Returns:
+ *  - 1 if the object is in the cache.
+ *  - 0 otherwise.
+ */
+static int tcache_holds(void *ptr) {
+    struct tcache *cache = thread_cache;
+    void *entry;
+
+    if ((NULL == cache) || (((void **)ptr)[1] != cache)) {
+        return 0;
+    }
+    for (entry = cache->entries[SLAB_OF(ptr)->size_class]; entry; entry = *(void **)entry) {
+        if (entry == ptr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Puts a freed slab object in the cache of the calling thread.
+ * When the size class becomes full, half of it is flushed back to the arenas.
+ *
+ * Parameters:
+ *  - ptr: The slab object being freed.
+ *
+ * Returns:
+ *  - 1 if the object was cached.
+ *  - 0 if the thread has no cache.
+ */
+static int tcache_put(void *ptr) {
+    struct tcache *cache = tcache_self();
+    unsigned int index;
+
+    if (NULL == cache) {
+        return 0;
+    }
+    index = SLAB_OF(ptr)->size_class;
+    *(void **)ptr = cache->entries[index];
+    ((void **)ptr)[1] = cache;
+    cache->entries[index] = ptr;
+    cache->counts[index]++;
+    if (cache->counts[index] >= TCACHE_MAX_COUNT) {
+        tcache_flush(cache, index, TCACHE_MAX_COUNT / 2);
+    }
+    return 1;
+}
+
+/*
+ * Maps a new heap chunk for an arena.
+ *
+ * The chunk must be aligned to HEAP_CHUNK_SIZE. The kernel usually returns such an
+ * address when asked for exactly HEAP_CHUNK_SIZE bytes; when it does not, twice the
+ * size is mapped and the unaligned ends are unmapped. Only the address space is
+ * reserved here, pages are backed by memory when they are first touched.
+ *
+ * Parameters:
+ *  - arena: The arena that will own the chunk.
+ *
+ * Returns:
+ *  - Pointer to the new chunk, made of a single free block that is not in any bin.
+ *  - NULL if the mapping fails.
+ */
+static struct heap_chunk *chunk_map(struct arena *arena) {
+    struct heap_chunk *chunk;
+    struct meta_data *block;
+    char *memory = os_mmap(NULL, HEAP_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    if ((uintptr_t)memory & (HEAP_CHUNK_SIZE - 1)) {
+        char *aligned;
+        os_munmap(memory, HEAP_CHUNK_SIZE);
+        memory = os_mmap(NULL, 2 * HEAP_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+        aligned = (char *)(((uintptr_t)memory + HEAP_CHUNK_SIZE - 1) & ~((uintptr_t)HEAP_CHUNK_SIZE - 1));
+        // Unmap the part before the aligned chunk and the part after it
+        if (aligned != memory) {
+            os_munmap(memory, aligned - memory);
+        }
+        os_munmap(aligned + HEAP_CHUNK_SIZE, HEAP_CHUNK_SIZE - (aligned - memory));
+        memory = aligned;
+    }
+    __atomic_fetch_add(&num_block, 1, __ATOMIC_RELAXED);
+
+    chunk = (struct heap_chunk *)memory;
+    chunk->arena = arena;
+    chunk->size = HEAP_CHUNK_SIZE;
+    block = (struct meta_data *)(chunk + 1);
+    block->next_block = NULL;
+    block->prev_block = NULL;
+    block->size = CHUNK_BLOCK_SIZE;
+    block->flag = freeBlock;
+    // Fresh anonymous pages read as zeros
+    block->zeroed = 1;
+    return chunk;
+}
+
+/*
+ * Gives the pages of a free block back to the OS.
+ *
+ * Pages holding the header and the free-list links of the block are never released.
+ * The released pages read as zeros when touched again, the bytes around them are
+ * cleared too so the block is marked zeroed. madvise fails on locked pages, which
+ * then keep their contents, so the block is only marked zeroed when it worked.
+ *
+ * Parameters:
+ *  - block: The free block, not marked zeroed.
+ *
+ * Returns:
+ *  - 1 if the block was marked zeroed.
+ *  - 0 otherwise.
+ */
+static int release_pages(struct meta_data *block) {
+    uintptr_t mask = ~((uintptr_t)page_size - 1);
+    char *links_end = (char *)(block + 1) + MIN_BLOCK_SIZE;
+    char *block_end = (char *)(block + 1) + block->size;
+    // Whole pages inside the block, after its free-list links
+    char *first = (char *)(((uintptr_t)links_end + page_size - 1) & mask);
+    char *last = (char *)((uintptr_t)block_end & mask);
+
+    if ((last > first) && (0 == os_madvise(first, last - first, MADV_DONTNEED))) {
+        memset(links_end, 0, first - links_end);
+        memset(last, 0, block_end - last);
+        block->zeroed = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the time of the coarse monotonic clock in milliseconds, it is read without
+ * entering the kernel.
+ */
+static unsigned long long monotonic_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Gives the pages of the free blocks of RELEASE_THRESHOLD bytes or more back to the OS.
+ * Blocks marked zeroed have no pages to give back and are skipped.
+ * The arena lock must be held.
+ *
+ * Parameters:
+ *  - arena: The arena to purge.
+ *
+ * Returns:
+ *  - None
+ */
+static void arena_purge(struct arena *arena) {
+    unsigned int index = next_bin(arena, bin_index(RELEASE_THRESHOLD));
+    struct meta_data *block;
+
+    while (index < NUM_BINS) {
+        for (block = arena->bins[index]; block; block = FREE_LINKS(block)->next_free) {
+            // A block whose pages could not be released stays dirty
+            if (!block->zeroed && (block->size >= RELEASE_THRESHOLD) && release_pages(block)) {
+                arena->dirty_bytes -= block->size;
+            }
+        }
+        index = next_bin(arena, index + 1);
+    }
+    // The pages left are locked, only what is freed from now on counts
+    arena->purge_floor = arena->dirty_bytes;
+    arena->purge_time = monotonic_ms();
+}
+
+/*
+ * Tells whether the arena should give the pages of its big free blocks back now.
+ * The arena lock must be held.
+ *
+ * Parameters:
+ *  - arena: The arena to check.
+ *
+ * Returns:
+ *  - 1 if arena_purge should run.
+ *  - 0 otherwise.
+ */
+static inline int purge_due(struct arena *arena) {
+    size_t dirty = arena->dirty_bytes - arena->purge_floor;
+
+    return (dirty > PURGE_THRESHOLD)
+        && ((dirty > PURGE_LIMIT) || (monotonic_ms() - arena->purge_time >= PURGE_INTERVAL));
+}
+
+/*
+ * Allocates a block in a mapping of its own, for requests of mmap_threshold bytes or more.
+ *
+ * Parameters:
+ *  - size: The aligned size requested.
+ *
+ * Returns:
+ *  - Pointer to the allocated memory.
+ *  - NULL if the mapping fails.
+ */
+static void *mmap_block(size_t size) {
+    struct meta_data *block;
+    size_t length;
+
+    if (size > SIZE_MAX - META_SIZE - page_size) {
+        return NULL;
+    }
+    length = (size + META_SIZE + page_size - 1) & ~(page_size - 1);
+    block = os_mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        return NULL;
+    }
+    block->next_block = NULL;
+    block->prev_block = NULL;
+    block->size = length - META_SIZE;
+    block->flag = mmappedBlock;
+    block->zeroed = 1;
+    __atomic_fetch_add(&mmapped_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mmapped_bytes, block->size, __ATOMIC_RELAXED);
+    return (void *)(block + 1);
+}
+
+/*
+ * Allocates a block with a big alignment in a mapping of its own.
+ *
+ * The mapping is made big enough to hold the aligned block wherever the kernel puts
+ * it, then the whole pages before the page of the header and after the block are
+ * unmapped. When the header is not at the start of what remains, prev_block keeps
+ * that start so the block can be unmapped and resized.
+ *
+ * Parameters:
+ *  - size: The aligned size requested.
+ *  - alignment: The alignment, a power of two bigger than MALLOC_ALIGNMENT.
+ *
+ * Returns:
+ *  - Pointer to the allocated memory.
+ *  - NULL if the mapping fails.
+ */
+static void *mmap_block_aligned(size_t size, size_t alignment) {
+    struct meta_data *block;
+    char *memory;
+    char *start;
+    char *end;
+    size_t length;
+
+    if (size > SIZE_MAX - META_SIZE - alignment - page_size) {
+        return NULL;
+    }
+    length = ALIGN_UP(size + META_SIZE + alignment, page_size);
+    memory = os_mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    block = (struct meta_data *)(ALIGN_UP((uintptr_t)memory + META_SIZE, alignment) - META_SIZE);
+    start = (char *)((uintptr_t)block & ~((uintptr_t)page_size - 1));
+    end = (char *)ALIGN_UP((uintptr_t)(block + 1) + size, page_size);
+    if (start != memory) {
+        os_munmap(memory, start - memory);
+    }
+    if (end != memory + length) {
+        os_munmap(end, memory + length - end);
+    }
+    block->next_block = NULL;
+    block->prev_block = ((char *)block == start) ? NULL : (struct meta_data *)start;
+    block->size = end - (char *)(block + 1);
+    block->flag = mmappedBlock;
+    block->zeroed = 1;
+    __atomic_fetch_add(&mmapped_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mmapped_bytes, block->size, __ATOMIC_RELAXED);
+    return (void *)(block + 1);
+}
+
+/*
+ * Returns the start of the mapping of a block that has a mapping of its own.
+ *
+ * Parameters:
+ *  - block: The block, flagged mmappedBlock.
+ *
+ * Returns:
+ *  - The start of the mapping, the end is the end of the block payload.
+ */
+static char *mmap_start(struct meta_data *block) {
+    return block->prev_block ? (char *)block->prev_block : (char *)block;
+}
+
+/*
+ * Resizes a block that has a mapping of its own.
+ *
+ * mremap may move the mapping to another address, the kernel then moves the page
+ * table entries and no data is copied. Shrinking unmaps the pages past the new end.
+ * The header keeps its offset in the mapping, so the block keeps its alignment to
+ * the page size but not a bigger one.
+ *
+ * Parameters:
+ *  - block: The block, flagged mmappedBlock.
+ *  - size: The new aligned size.
+ *
+ * Returns:
+ *  - Pointer to the resized memory, the old pointer is no longer valid.
+ *  - NULL if the mapping can not be resized, the old block is left untouched.
+ */
+static void *mremap_block(struct meta_data *block, size_t size) {
+    char *start = mmap_start(block);
+    size_t offset = (char *)block - start;
+    size_t old_length = offset + META_SIZE + block->size;
+    size_t length;
+
+    if (size > SIZE_MAX - offset - META_SIZE - page_size) {
+        return NULL;
+    }
+    length = ALIGN_UP(offset + META_SIZE + size, page_size);
+    if (length == old_length) {
+        return (void *)(block + 1);
+    }
+    start = os_mremap(start, old_length, length, MREMAP_MAYMOVE);
+    if (start == MAP_FAILED) {
+        return NULL;
+    }
+    __atomic_fetch_add(&mmapped_bytes, length - old_length, __ATOMIC_RELAXED);
+    block = (struct meta_data *)(start + offset);
+    if (offset) {
+        block->prev_block = (struct meta_data *)start;
+    }
+    block->size = length - offset - META_SIZE;
+    return (void *)(block + 1);
+}
+
+/*
+ * Draws the number of bytes the calling thread allocates before its next sample,
+ * uniformly between 1 and twice prof_rate so samples do not follow the allocation pattern.
+ *
+ * Parameters: None
+ *
+ * Returns:
+ *  - The number of bytes.
+ */
+static size_t prof_interval(void) {
+    // Every thread gets its own sequence, seeded by the address of its variables
+    if (0 == prof_random) {
+        prof_random = (uintptr_t)&prof_random | 1;
+    }
+    prof_random ^= prof_random << 13;
+    prof_random ^= prof_random >> 7;
+    prof_random ^= prof_random << 17;
+    return 1 + prof_random % (2 * prof_rate);
+}
+
+/*
+ * Tells whether the heap profiler samples an allocation of the calling thread.
+ *
+ * Parameters:
+ *  - size: The aligned size requested.
+ *
+ * Returns:
+ *  - 1 if the allocation must be sampled.
+ *  - 0 otherwise, also while the thread is already taking a sample.
+ */
+static int prof_should_sample(size_t size) {
+    if (0 == prof_bytes_left) {
+        prof_bytes_left = prof_interval();
+    }
+    if (size < prof_bytes_left) {
+        prof_bytes_left -= size;
+        return 0;
+    }
+    prof_bytes_left = prof_interval();
+    return !prof_busy;
+}
+
+/*
+ * Takes an unused sample, mapping a new pool of samples when there is none left.
+ * The prof_lock must be held.
+ *
+ * Parameters: None
+ *
+ * Returns:
+ *  - Pointer to the sample.
+ *  - NULL if the pool can not be mapped.
+ */
+static struct prof_sample *prof_sample_get(void) {
+    struct prof_sample *sample = prof_free_samples;
+    size_t i;
+
+    if (NULL == sample) {
+        sample = os_mmap(NULL, PROF_POOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (sample == MAP_FAILED) {
+            return NULL;
+        }
+        for (i = 0; i < PROF_POOL_SIZE / sizeof(struct prof_sample); i++) {
+            sample[i].next = prof_free_samples;
+            prof_free_samples = &sample[i];
+        }
+        prof_sample_count += i;
+        sample = prof_free_samples;
+    }
+    prof_free_samples = sample->next;
+    return sample;
+}
+
+/* Computes the bucket of prof_table that holds the sample of an allocation. */
+static unsigned int prof_bucket(const void *ptr) {
+    return ((uintptr_t)ptr >> 3) % PROF_TABLE_SIZE;
+}
+
+/*
+ * Allocates a block for an allocation that the heap profiler sampled and records the
+ * call stack that made it.
+ *
+ * The allocation gets a heap block, or a mapping of its own when it is big enough, whose
+ * flag is marked with sampledBlock so my_free knows it must forget the sample.
+ *
+ * Parameters:
+ *  - arena: The arena of the calling thread.
+ *  - size: The aligned size requested.
+ *
+ * Returns:
+ *  - Pointer to the allocated memory.
+ *  - NULL if memory allocation fails.
+ */
+static void *prof_malloc(struct arena *arena, size_t size) {
+    struct prof_sample *sample;
+    struct meta_data *block;
+    unsigned int bucket;
+    void *ptr;
+
+    // backtrace may allocate when it is first used, such allocations are not sampled
+    prof_busy = 1;
+    if (size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        ptr = mmap_block(size);
+    }
+    else {
+        arena_lock(arena);
+        block = needed_block(arena, size);
+        arena_unlock(arena);
+        ptr = block ? (void *)(block + 1) : NULL;
+    }
+    if (ptr) {
+        pthread_mutex_lock(&prof_lock);
+        sample = prof_sample_get();
+        pthread_mutex_unlock(&prof_lock);
+        if (sample) {
+            sample->depth = backtrace(sample->stack, PROF_MAX_DEPTH);
+            sample->ptr = ptr;
+            sample->size = size;
+            (((struct meta_data *)ptr) - 1)->flag |= sampledBlock;
+            bucket = prof_bucket(ptr);
+            pthread_mutex_lock(&prof_lock);
+            sample->next = prof_table[bucket];
+            // hmm_prof_dump reads the table without the lock, publish the sample once it is complete
+            __atomic_store_n(&prof_table[bucket], sample, __ATOMIC_RELEASE);
+            prof_live_samples++;
+            pthread_mutex_unlock(&prof_lock);
+        }
+    }
+    prof_busy = 0;
+    return ptr;
+}
+
+/*
+ * Forgets the sample of a sampled allocation that is freed or resized.
+ *
+ * Parameters:
+ *  - ptr: The sampled allocation.
+ *
+ * Returns:
+ *  - None
+ */
+static void prof_forget(void *ptr) {
+    struct prof_sample **link = &prof_table[prof_bucket(ptr)];
+    struct prof_sample *sample;
+
+    pthread_mutex_lock(&prof_lock);
+    for (sample = *link; sample; link = &sample->next, sample = *link) {
+        if (sample->ptr == ptr) {
+            __atomic_store_n(link, sample->next, __ATOMIC_RELEASE);
+            sample->next = prof_free_samples;
+            prof_free_samples = sample;
+            prof_live_samples--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * Writes a number in a buffer, without any function that is not async-signal-safe.
+ *
+ * Parameters:
+ *  - out: The buffer, it must have room for 20 characters.
+ *  - value: The number.
+ *  - base: 10 or 16.
+ *
+ * Returns:
+ *  - Number of characters written.
+ */
+static size_t prof_format(char *out, unsigned long long value, unsigned int base) {
+    char digits[20];
+    size_t count = 0;
+    size_t length = 0;
+
+    do {
+        digits[count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+    while (count) {
+        out[length++] = digits[--count];
+    }
+    return length;
+}
+
+static void prof_signal(int sig) {
+    int saved_errno = errno;
+
+    (void)sig;
+    hmm_prof_dump();
+    errno = saved_errno;
+}
 
 /*
  * Initializes the memory management system.
  * 
  * This function sets up the initial state of the memory management system by:
- * 1. Allocating memory for the initial free list using the sbrk system call.
- * 2. Determining the current program break and storing it in ProgBreak.
- * 3. Initializing the number of blocks to 1.
- * 4. Setting the flag of the first block in the free list to indicate it's free.
- * 5. Setting the next block pointer of the first block to NULL, indicating no further blocks yet.
- * 6. Setting the size of the first block in the free list based on the allocated memory size.
- * 7. Updating the tail pointer to point to the end of the allocated memory block.
+ * 1. Reading the page size of the system, used to release free pages.
+ * 2. Choosing the number of arenas from the number of online CPUs.
+ * 3. Reserving the address range of the slab pages. Only address space is reserved,
+ *    a smaller range is tried when the full SLAB_REGION_SIZE can not be reserved and
+ *    small requests use heap blocks when no range can be reserved at all.
+ * 4. Starting the heap profiler when HMM_PROF_SAMPLE is set, PROF_SIGNAL then writes
+ *    the profile to the file named by HMM_PROF_FILE.
+ * 5. Reading the mmap threshold from the HMM_MMAP_THRESHOLD environment variable.
+ * The arenas themselves get their first heap chunk when they are first used.
  * 
  * Parameters: None
  * 
  * Returns: None
  */
 void init_fun(void) {
-    // Allocate memory for the initial free list
-    free_list = sbrk(PBR_STEP);
-    // Set ProgBreak to the current program break
-    ProgBreak = sbrk(0);
-    // Initialize the number of blocks
-    num_block = 1;
-    // Set the flag of the first block to indicate it's free
-    free_list->flag = 1;
-    // Set the next block pointer of the first block to NULL
-    free_list->next_block = NULL;
-    // Set the size of the first block in the free list
-    free_list->size = PBR_STEP - META_SIZE;
+    long size = sysconf(_SC_PAGESIZE);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int count = 1;
+    size_t region = SLAB_REGION_SIZE;
+    char *memory;
+    char *aligned;
+
+    if (size > 0) {
+        page_size = size;
+    }
+    // Give every CPU a few arenas so threads rarely share one
+    if (cpus > 0) {
+        count = cpus * ARENAS_PER_CPU;
+    }
+    if (count > MAX_ARENAS) {
+        count = MAX_ARENAS;
+    }
+    // Reserve the slab range aligned to SLAB_PAGE_SIZE, without making it writable yet
+    for (; region >= SLAB_COMMIT_STEP; region /= 2) {
+        memory = os_mmap(NULL, region + SLAB_PAGE_SIZE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (memory == MAP_FAILED) {
+            continue;
+        }
+        aligned = (char *)(((uintptr_t)memory + SLAB_PAGE_SIZE - 1) & ~((uintptr_t)SLAB_PAGE_SIZE - 1));
+        if (aligned != memory) {
+            os_munmap(memory, aligned - memory);
+        }
+        os_munmap(aligned + region, SLAB_PAGE_SIZE - (aligned - memory));
+        slab_top = aligned;
+        slab_committed = aligned;
+        slab_base = (uintptr_t)aligned;
+        slab_size = region;
+        break;
+    }
+    // Sample one allocation every HMM_PROF_SAMPLE bytes
+    if (getenv("HMM_PROF_SAMPLE")) {
+        prof_rate = strtoul(getenv("HMM_PROF_SAMPLE"), NULL, 0);
+    }
+    if (prof_rate) {
+        struct sigaction action;
+
+        if (getenv("HMM_PROF_FILE")) {
+            prof_file = getenv("HMM_PROF_FILE");
+        }
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = prof_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(PROF_SIGNAL, &action, NULL);
+    }
+    // Let the environment move the size from which requests get a mapping of their own
+    if (getenv("HMM_MMAP_THRESHOLD")) {
+        my_mallopt(M_MMAP_THRESHOLD, atoi(getenv("HMM_MMAP_THRESHOLD")));
+    }
+    __atomic_store_n(&num_arenas, count, __ATOMIC_RELEASE);
 }
 
 /*
  * Finds a suitable free block for memory allocation or extends the heap if necessary.
  * 
- * This function traverses the linked list of free memory blocks to find a block 
- * that can accommodate the requested size. If such a block is found, it returns a 
- * pointer to that block. If not, it extends the heap by requesting additional memory 
- * using the sbrk system call and then initializes metadata for the newly allocated block.
+ * This function looks in the size bins of the arena for a free block that can accommodate
+ * the requested size. If such a block is found, it is unlinked from its bin and returned.
+ * If not, it extends the arena by mapping a new heap chunk with mmap and returns the
+ * free block that covers it. The arena lock must be held.
  * 
  * Parameters:
- *  - size: The size of memory requested for allocation.
+ *  - arena: The arena to allocate from.
+ *  - size: The size of memory requested for allocation, at most CHUNK_BLOCK_SIZE.
  * 
  * Returns:
  *  - Pointer to the suitable free block if found.
  *  - NULL if no suitable block is found or memory extended fails.
  */
-struct meta_data *find_free_block(size_t size) {
-    // Start the search from the beginning of the free list
-    struct meta_data *current = free_list;
-    // Variable to track if a suitable block is found
-    char check = 0;
+struct meta_data *find_free_block(struct arena *arena, size_t size) {
+    // Look for a free block in the size bins first
+    struct meta_data *current = bin_take(arena, size);
+    struct heap_chunk *chunk;
 
-    if (current == NULL){
-        return NULL;
-    }
-    
-    // Loop until a suitable block is found or the end of the free list is reached
-    while (1) {
-        // Check if the current block is large enough and free
-        if (((current->size > size) || (current->size == size)) && (current->flag)) {
-            // Suitable block found
-            check = 1;
-            break;
-        } 
-        else {
-            // Move to the next block in the free list
-            if (!(current->next_block)) {
-                // End of the free list reached without finding a suitable block
-                check = 0;
-                break;
-            } else {
-                current = current->next_block;
-            }
-        }
-    }
-    // If no suitable block is found, extend the heap
-    if (!check) {
-        while (1) {
-            // Extend the heap by requesting additional memory till it suits the needed size
-            current->next_block = sbrk(PBR_STEP);
-            num_block++;
-            // Check if the previous block was free
-            if ((current->flag) == freeBlock) {
-                // Increase the size of the previous block with the added heap memory
-                current->size += PBR_STEP;
-                current->next_block = NULL;
-
-                // Check if the enlarged block can accommodate the requested size
-                if ((size < current->size) || (size == current->size)) {
-                    return current;
-                }
-                //continue in moving program break to add more free space
-                else{
-                    continue;
-                }
-            } 
-            else if ((current->flag) == busyBlock) {
-                // Initialize the metadata of the newly allocated block
-                current->next_block->size = PBR_STEP - META_SIZE;
-
-                // Check if the newly allocated block can accommodate the requested size
-                if ((size < current->next_block->size) || (size == current->next_block->size)) {
-                    return current->next_block;
-                }
-                //continue in moving program break to add more free space
-                else{
-                    continue;
-                }
-            }
-        }
-    } 
-    //i found a suitable block in my free list
-    else if (check) {
-        // Return the pointer to the suitable block if found
+    if (current) {
         return current;
     }
-    // Return NULL if no suitable block is found
-    return NULL;
+
+    // No suitable block is found, extend the arena with a new chunk
+    chunk = chunk_map(arena);
+    if (NULL == chunk) {
+        return NULL;
+    }
+    // The new chunk is empty until needed_block uses its block
+    arena->free_chunks++;
+    return (struct meta_data *)(chunk + 1);
 }
 
 /*
  * Allocates a block of memory of the required size.
  * 
- * This function attempts to find a suitable free block of memory using the find_free_block
+ * This function first runs the purge of the arena when it is due and no free has run
+ * it, then attempts to find a suitable free block of memory using the find_free_block
  * function. If a suitable block is found, it marks the block as busy and checks if the 
  * block can be split to accommodate the requested size. If splitting is possible, it 
  * creates a new free block. Finally, it returns a pointer to the allocated block.
+ * The arena lock must be held.
  * 
  * Parameters:
+ *  - arena: The arena to allocate from.
  *  - size: The size of memory requested for allocation.
  * 
  * Returns:
  *  - Pointer to the allocated block if successful.
  *  - NULL if no suitable block is found or memory allocation fails.
  */
-struct meta_data *needed_block(size_t size) {
+struct meta_data *needed_block(struct arena *arena, size_t size) {
+    struct meta_data *block;
+
+    // Run a purge that no free has run since its interval passed
+    if (purge_due(arena)) {
+        arena_purge(arena);
+    }
     // Find a suitable free block for allocation
-    struct meta_data *block = find_free_block(size);
+    block = find_free_block(arena, size);
     // Check if a suitable block is found
     if (block) {
+        // A block without neighbours covers a whole chunk, that chunk is no longer empty
+        if ((NULL == block->prev_block) && (NULL == block->next_block)) {
+            arena->free_chunks--;
+        }
         // Mark the block as busy
         block->flag = busyBlock;
         // Check if the block can be split to accommodate the requested size
@@ -174,6 +1633,7 @@ struct meta_data *needed_block(size_t size) {
         } else {
             // No need to split the block
         }
+        arena->stats.heap_bytes += block->size;
         // Return the allocated block
         return block;
     }
@@ -183,50 +1643,81 @@ struct meta_data *needed_block(size_t size) {
 /*
  * Allocates a block of memory of the required size using a custom memory management system.
  * 
- * This function first checks if the free list is NULL. If so, it initializes the memory management
- * system using the init_fun function. Then, it checks if the requested block size is negative.
- * If the size is valid, it adjusts the size to ensure proper alignment. Next, it calls the needed_block
- * function to find a suitable free block for allocation. If a block is successfully allocated,
- * it updates the program break and returns a pointer to the allocated memory block.
+ * This function first checks if the requested block size is negative, that is bigger than
+ * PTRDIFF_MAX as a negative int becomes once converted. If the size is valid, it adjusts the
+ * size to ensure proper alignment. Allocations picked by the heap profiler get a heap block
+ * marked sampledBlock. Sizes up to SLAB_MAX_SIZE get an object of a slab page, served from
+ * the cache of the calling thread without locking. Requests of mmap_threshold bytes or more
+ * get a mapping of their own.
+ * Otherwise, it takes the lock of the arena of the calling thread and calls the needed_block
+ * function to find a suitable free block for allocation, then returns a pointer to the
+ * allocated memory block.
  * 
  * Parameters:
  *  - block_size: The size of memory requested for allocation.
  * 
  * Returns:
  *  - Pointer to the allocated block if successful.
- *  - NULL if memory allocation fails or the requested block size is negative.
+ *  - NULL, with errno set to ENOMEM, if memory allocation fails or the requested block
+ *    size is negative.
  */
 void *my_malloc(size_t block_size) {
     void *return_ptr;
-    
-    // Check if the free list is NULL
-    if (NULL == free_list) {
-        // Initialize the memory management system
-        init_fun(); 
-    }
-    else {
-        /**/
-    }
+    struct arena *arena;
     
     // Check if the requested block size is negative
-    if (block_size < 0) {
+    if (block_size > PTRDIFF_MAX) {
+        errno = ENOMEM;
         return NULL;
     } 
     else {
-        // Adjust block size to ensure proper alignment (assuming 8-byte alignment)
-        block_size = ((block_size + 7) / 8) * 8;
+        // Adjust block size to ensure proper alignment
+        block_size = ALIGN_UP(block_size, MALLOC_ALIGNMENT);
+        // A block must be able to hold the free-list links once it is freed
+        if (block_size < MIN_BLOCK_SIZE) {
+            block_size = MIN_BLOCK_SIZE;
+        }
+
+        // The arena of the thread is set up first, init_fun reserves the slab range
+        // and may change mmap_threshold
+        arena = arena_self();
+
+        // Let the heap profiler sample this allocation, it then gets a block with a header
+        if (prof_rate && prof_should_sample(block_size)) {
+            return_ptr = prof_malloc(arena, block_size);
+            if (return_ptr) {
+                return return_ptr;
+            }
+        }
+
+        // Serve small sizes from slab pages, through the cache of this thread
+        if ((block_size <= SLAB_MAX_SIZE) && slab_size) {
+            return_ptr = tcache_get(slab_class(block_size));
+            if (return_ptr) {
+                return return_ptr;
+            }
+        }
+
+        // Give big requests a mapping of their own
+        if (block_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+            return_ptr = mmap_block(block_size);
+            if (NULL == return_ptr) {
+                errno = ENOMEM;
+            }
+            return return_ptr;
+        }
         
-        // Find a suitable free block for allocation
-        struct meta_data *current = needed_block(block_size);
+        // Find a suitable free block for allocation in the arena of this thread
+        arena_lock(arena);
+        struct meta_data *current = needed_block(arena, block_size);
+        arena_unlock(arena);
         
         // Check if a block is successfully allocated
         if (NULL == current) {
+            errno = ENOMEM;
             return (void *)current;
         } 
         else {
-            // Update the program break
-            //ProgBreak = sbrk(0);
-            
             // Move the pointer to the next memory location after metadata
             current += 1;
             
@@ -245,8 +1736,10 @@ void *my_malloc(size_t block_size) {
  * This function allocates a block of memory large enough to fit 'num' elements,
  * each of size 'size' bytes. It checks for invalid input parameters and returns
  * NULL if 'num' or 'size' is zero, or if their product would result in an overflow.
- * Otherwise, it allocates the memory using my_malloc, initializes the memory block
- * with zeros using memset, and returns a pointer to the allocated memory.
+ * Otherwise, it allocates the memory using my_malloc and initializes the memory block
+ * with zeros using memset. A block marked zeroed still holds the zeros of the OS, so
+ * only its first MIN_BLOCK_SIZE bytes are cleared, which keeps untouched pages of big
+ * zero-initialized tables from being faulted in.
  * 
  * Parameters:
  *  - num: Number of elements.
@@ -254,25 +1747,36 @@ void *my_malloc(size_t block_size) {
  * 
  * Returns:
  *  - Pointer to the allocated and initialized memory block if successful.
- *  - NULL if memory allocation fails or the input parameters are invalid.
+ *  - NULL if 'num' or 'size' is zero.
+ *  - NULL, with errno set to ENOMEM, if the product overflows or memory allocation fails.
  */
 void *my_calloc(size_t num, size_t size) {
+    size_t total;
+    void *ret_ptr;
+
     // Check if either 'num' or 'size' is zero
     if ((num == 0) || (size == 0)) {
         return NULL;
     }
-    // Check for potential overflow when calculating the total memory size
-    else if (num * size < 0) {
+    // Check for overflow when calculating the total memory size
+    else if (__builtin_mul_overflow(num, size, &total)) {
+        errno = ENOMEM;
         return NULL;
     }
     else {
         // Allocate memory for 'num' elements of size 'size' using my_malloc
-        void *ret_ptr = my_malloc(size * num);
+        ret_ptr = my_malloc(total);
         
         // Check if memory allocation was successful
         if (ret_ptr != NULL) {
-            // Initialize the memory block with zeros using memset
-            memset(ret_ptr, 0, size * num);
+            if (!is_slab(ret_ptr) && (((struct meta_data *)ret_ptr) - 1)->zeroed) {
+                // Only the free-list links may be left in a block that still holds the zeros of the OS
+                memset(ret_ptr, 0, (total < MIN_BLOCK_SIZE) ? total : MIN_BLOCK_SIZE);
+            }
+            else {
+                // Initialize the memory block with zeros using memset
+                memset(ret_ptr, 0, total);
+            }
         }
         
         // Return the pointer to the allocated and initialized memory block
@@ -286,11 +1790,15 @@ void *my_calloc(size_t num, size_t size) {
  * This function reallocates the memory block pointed to by 'ptr' to a new size specified
  * by 'new_size'. If 'ptr' is NULL, it behaves like malloc and allocates a new memory block.
  * If 'new_size' is zero, it deallocates the memory block pointed to by 'ptr' and behaves
- * like free. Otherwise, it attempts to resize the existing memory block. If resizing is
+ * like free. A slab object is kept when the new size fits its size class and moved
+ * otherwise. A block with a mapping of its own is resized with mremap, which lets the
+ * kernel move the pages instead of copying them. Otherwise, it attempts to resize the
+ * existing memory block. If resizing is
  * successful and the next block is free and large enough to accommodate the difference
  * in sizes, the function splits the next block and creates a new free block after resizing
  * the current block. If the next block is not free or is not large enough, the function
  * allocates a new memory block, copies the data from the old block, and frees the old block.
+ * The bytes past the old size are not cleared, like the memory returned by my_malloc.
  * 
  * Parameters:
  *  - ptr: Pointer to the previously allocated memory block.
@@ -317,84 +1825,134 @@ void *my_realloc(void *ptr, size_t new_size) {
         void *ptr_old = ptr;
         void *ptr_new = NULL;
         struct meta_data *current = ((struct meta_data *)ptr) - 1;
-        size_t old_size = current->size;
-        signed int diff_size = new_size - old_size;
-        
+        struct meta_data *next;
+        struct arena *arena;
+        size_t old_size;
+        size_t diff_size;
+
+        // Check if the new size is negative, like my_malloc does
+        if (new_size > PTRDIFF_MAX) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        // Keep the same alignment as my_malloc
+        new_size = ALIGN_UP(new_size, MALLOC_ALIGNMENT);
+
+        // A slab object has no header, its size is the object size of its slab page
+        if (is_slab(ptr)) {
+            old_size = SLAB_OF(ptr)->object_size;
+            if (new_size <= old_size) {
+                return ptr_old;
+            }
+            ptr_new = my_malloc(new_size);
+            if (ptr_new != NULL) {
+                memcpy(ptr_new, ptr_old, old_size);
+                my_free(ptr_old);
+            }
+            return ptr_new;
+        }
+        old_size = current->size;
+        // A sampled block that is resized is no longer sampled
+        if (current->flag & sampledBlock) {
+            prof_forget(ptr);
+            current->flag &= ~sampledBlock;
+        }
+
+        // Let the kernel resize a block that has a mapping of its own
+        if (current->flag == mmappedBlock) {
+            ptr_new = mremap_block(current, new_size);
+            if (NULL == ptr_new) {
+                errno = ENOMEM;
+            }
+            return ptr_new;
+        }
+
         // Check if the new size is the same as the old size or smaller
-        if (old_size == new_size || 0 > diff_size) {
+        if (new_size <= old_size) {
             // No need to reallocate, return the old pointer
             return ptr_old;
         }
-        
-        // Check if the next block exists
-        if (current->next_block) {
-            // Check if the next block is free
-            if (current->next_block->flag) {
-                // Check if the size of the next block is sufficient to accommodate the difference in sizes
-                if ((current->next_block->size) > diff_size) {
-                    // Calculate the size of the remaining free block after resizing
-                    size_t size_ = current->next_block->size - diff_size;
-                    
-                    // Create a new free block after resizing the current block
-                    struct meta_data *ptr_next = (void *)(((void *)current->next_block) + diff_size);
-                    ptr_next->next_block = current->next_block->next_block;
-                    ptr_next->flag = freeBlock;
-                    ptr_next->size = size_;
-                    current->next_block = ptr_next;
-                    current->size = new_size;
-                    ptr_new = ((void *)(current + 1));
-                    
-                    // Initialize the newly allocated memory with zeros
-                    memset((ptr_new + old_size), 0, diff_size);
-                } 
-                else {
-                    // Allocate a new memory block since the next block is not large enough
-                    ptr_new = my_malloc(new_size);
-                    if (ptr_new != NULL) {
-                        // Copy data from the old block to the new block
-                        ptr_new = memcpy(ptr_new, ptr_old, current->size);
-                        memset((ptr_new + old_size), 0, diff_size);
-                        // Free the old memory block
-                        my_free(ptr_old);
-                    }
+        diff_size = new_size - old_size;
+
+        // Check if the next block exists, is free and can give the difference in sizes
+        arena = CHUNK_OF(current)->arena;
+        arena_lock(arena);
+        next = current->next_block;
+        if (next && (next->flag == freeBlock) && (next->size + META_SIZE >= diff_size)) {
+            bin_remove(arena, next);
+            if (next->size >= diff_size + MIN_BLOCK_SIZE) {
+                // Calculate the size of the remaining free block after resizing
+                size_t size_ = next->size - diff_size;
+                // The new header may overwrite the one of the next block, read it first
+                char zeroed = next->zeroed;
+
+                // Create a new free block after resizing the current block
+                struct meta_data *ptr_next = (void *)(((void *)next) + diff_size);
+                ptr_next->next_block = next->next_block;
+                ptr_next->prev_block = current;
+                ptr_next->flag = freeBlock;
+                ptr_next->size = size_;
+                ptr_next->zeroed = zeroed;
+                bin_insert(arena, ptr_next);
+                if (ptr_next->next_block) {
+                    ptr_next->next_block->prev_block = ptr_next;
                 }
-            } 
+                current->next_block = ptr_next;
+                current->size = new_size;
+            }
             else {
-                // Allocate a new memory block since the next block is not free
-                ptr_new = my_malloc(new_size);
-                if (ptr_new != NULL) {
-                    // Copy data from the old block to the new block
-                    ptr_new = memcpy(ptr_new, ptr_old, current->size);
-                    memset((ptr_new + old_size), 0, diff_size);
-                    // Free the old memory block
-                    my_free(ptr_old);
+                // The remaining part is too small to be a block, take the whole next block
+                current->size += next->size + META_SIZE;
+                current->next_block = next->next_block;
+                if (current->next_block) {
+                    current->next_block->prev_block = current;
                 }
             }
-        } 
+            arena->stats.heap_bytes += current->size - old_size;
+            arena_unlock(arena);
+            ptr_new = ((void *)(current + 1));
+        }
         else {
-            // Allocate a new memory block since there's no next block
+            arena_unlock(arena);
+            // Allocate a new memory block since the next block can not be used
             ptr_new = my_malloc(new_size);
             if (ptr_new != NULL) {
                 // Copy data from the old block to the new block
-                ptr_new = memcpy(ptr_new, ptr_old, current->size);
-                
+                ptr_new = memcpy(ptr_new, ptr_old, old_size);
                 // Free the old memory block
                 my_free(ptr_old);
             }
         }
-        
+
         // Return the pointer to the reallocated memory block
         return ptr_new;
     }
 }
 
+/*
+ * Counts a double free, only the first one is reported on stderr.
+ * write() is used instead of stdio so reporting never allocates.
+ */
+static void report_double_free(void) {
+    static const char message[] = "hmm: previously freed memory block, further double frees are only counted\n";
+    ssize_t written;
+
+    if (0 == __atomic_fetch_add(&double_frees, 1, __ATOMIC_RELAXED)) {
+        written = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)written;
+    }
+}
+
 /*
  * Deallocates a previously allocated memory block.
  * 
  * This function deallocates the memory block pointed to by 'ptr'. If 'ptr' is NULL,
- * it does nothing. Otherwise, it traverses the free list to find the metadata corresponding
- * to the memory block pointed to by 'ptr'. If found, it marks the block as free and attempts
- * to merge adjacent free blocks to coalesce contiguous free memory blocks into larger ones.
+ * it does nothing. Slab objects, recognized by their address, are kept in the cache of the
+ * calling thread. Otherwise, it reads the metadata stored right before the memory block
+ * pointed to by 'ptr' and unmaps blocks with a mapping of their own. A double free is
+ * counted and reported once on stderr. Other blocks go back to the arena that owns
+ * their heap chunk, where they are marked as free and merged with their free neighbours,
+ * or left on the remote free list of the arena when another thread holds its lock.
  * 
  * Parameters:
  *  - ptr: Pointer to the previously allocated memory block.
@@ -410,79 +1968,276 @@ void my_free(void *ptr) {
     else {
         // Initialize variables
         struct meta_data *current_node = (struct meta_data*)(ptr) - 1;
-         if (current_node->flag == busyBlock) {
-            current_node->flag = freeBlock; // Flag = 1 indicates that this block is free
-            // Attempt to merge adjacent free blocks
-             merge_();
+        if (is_slab(ptr)) {
+            // A slab object has no header, its slab page tells whether it is still allocated
+            if (!slab_in_use(ptr) || tcache_holds(ptr)) {
+                report_double_free();
+                return;
+            }
+            // Keep the object in the cache of this thread, or give it back to its arena
+            if (!tcache_put(ptr)) {
+                arena_release_blocks(SLAB_OF(ptr)->arena, ptr, ptr);
+            }
+        }
+        else if ((current_node->flag & sampledBlock)
+                 && ((current_node->flag & ~sampledBlock) == busyBlock
+                     || (current_node->flag & ~sampledBlock) == mmappedBlock)) {
+            // Forget the sample, then free the block as if it had not been sampled
+            prof_forget(ptr);
+            current_node->flag &= ~sampledBlock;
+            my_free(ptr);
+        }
+        else if (current_node->flag == busyBlock) {
+            // Give the block back to its arena, it is merged with its free neighbours there
+            current_node->flag = cachedBlock;
+            arena_release_blocks(CHUNK_OF(current_node)->arena, ptr, ptr);
+        } 
+        else if (current_node->flag == mmappedBlock) {
+            // Unmap a block that has a mapping of its own
+            __atomic_fetch_sub(&mmapped_blocks, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&mmapped_bytes, current_node->size, __ATOMIC_RELAXED);
+            os_munmap(mmap_start(current_node), (char *)ptr + current_node->size - mmap_start(current_node));
         } 
         else {
-            // Print a message if the memory block was previously freed
-            printf("Previously freed memory block\n");
+            // Count the memory block that was previously freed
+            report_double_free();
         }
 
         
     }
 }
 /*
- * Merges adjacent free blocks to coalesce contiguous free memory blocks into larger ones.
+ * Allocates a block of memory whose address is a multiple of 'alignment'.
  * 
- * This function traverses the free list to find adjacent free memory blocks. If it finds
- * two consecutive free blocks, it merges them into a single larger free block. It also
- * handles the case where the program break needs to be adjusted if the last block in the
- * heap becomes smaller than the page size.
+ * It backs memalign, posix_memalign, aligned_alloc, valloc and pvalloc. Alignments up to
+ * MALLOC_ALIGNMENT are served by my_malloc. Small requests with an alignment up to 64
+ * bytes get a slab object of a class whose objects are all aligned. Other requests get
+ * a heap block big enough to hold the aligned block and a free block before it, the
+ * free block is carved off and merged with its free neighbours, and the tail is split
+ * off like in needed_block. Big requests get a mapping of their own whose unused pages
+ * are unmapped. The result is freed, merged and resized like any other block.
  * 
  * Parameters:
- *  - None
+ *  - alignment: The alignment, a power of two.
+ *  - size: The size of memory requested for allocation.
  * 
  * Returns:
- *  - None
+ *  - Pointer to the allocated memory if successful.
+ *  - NULL, with errno set to EINVAL if 'alignment' is not a power of two, or to ENOMEM
+ *    if memory allocation fails.
  */
-void merge_(void) {
-    // Initialize variables
-    struct meta_data *current_node = free_list;
-    struct meta_data *prev_node = NULL;
-    
-    // Traverse the free list to find adjacent free memory blocks
-    while (current_node) {
-        // Check if the current node and its next node exist
-        if (current_node->next_block) {
-            // Check if both current and next nodes are free
-            if ((freeBlock == current_node->flag) && (freeBlock == current_node->next_block->flag)) {
-                // Merge the current and next nodes into a single larger free block
-                current_node->size += current_node->next_block->size + META_SIZE;
-                current_node->next_block = current_node->next_block->next_block;
-            }
+void *my_memalign(size_t alignment, size_t size) {
+    struct arena *arena;
+    struct meta_data *block;
+    struct meta_data *aligned;
+    struct meta_data *tail;
+    size_t block_size;
+    size_t gap;
+    void *ptr;
+
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= MALLOC_ALIGNMENT) {
+        return my_malloc(size);
+    }
+    if ((size > PTRDIFF_MAX) || (alignment > PTRDIFF_MAX - size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // A heap block must be able to hold the links of a free block once it is freed
+    size = ALIGN_UP(size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size, MALLOC_ALIGNMENT);
+    arena = arena_self();
+
+    // Slab objects of a class whose size is a multiple of the alignment are all aligned,
+    // the objects of a slab page start on a 64-byte boundary
+    if ((alignment <= 64) && slab_size && (ALIGN_UP(size, alignment) <= SLAB_MAX_SIZE)) {
+        ptr = tcache_get(slab_class(ALIGN_UP(size, alignment)));
+        if (ptr) {
+            return ptr;
         }
-        
-        // Move to the next node
-        prev_node = current_node;
-        current_node = current_node->next_block;
-        
-        // Check if the end of the list is reached
-        if (current_node == NULL) {
-            break;
+    }
+
+    // Room for the block, for its alignment and for a free block before it
+    block_size = size + alignment + META_SIZE + MIN_BLOCK_SIZE;
+    if (block_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+        ptr = mmap_block_aligned(size, alignment);
+        if (NULL == ptr) {
+            errno = ENOMEM;
         }
-        
-        // Check if both previous and current nodes are free
-        if (prev_node) {
-            if ((freeBlock == prev_node->flag) && (freeBlock == current_node->flag)) {
-                // Merge the previous and current nodes into a single larger free block
-                prev_node->size += current_node->size + META_SIZE;
-                prev_node->next_block = current_node->next_block; 
-                // Move to the next node
-                current_node = prev_node->next_block;
-            }
+        return ptr;
+    }
+
+    arena_lock(arena);
+    block = needed_block(arena, block_size);
+    if (NULL == block) {
+        arena_unlock(arena);
+        errno = ENOMEM;
+        return NULL;
+    }
+    arena->stats.heap_bytes -= block->size;
+    // The part before the aligned block must be able to hold a free block
+    aligned = (struct meta_data *)(ALIGN_UP((uintptr_t)(block + 1), alignment) - META_SIZE);
+    while ((aligned != block) && ((size_t)((char *)aligned - (char *)block) < META_SIZE + MIN_BLOCK_SIZE)) {
+        aligned = (struct meta_data *)((char *)aligned + alignment);
+    }
+    if (aligned != block) {
+        // Carve off the part before the aligned block as a free block
+        gap = (char *)aligned - (char *)block;
+        aligned->size = block->size - gap;
+        aligned->flag = busyBlock;
+        aligned->zeroed = block->zeroed;
+        aligned->prev_block = block;
+        aligned->next_block = block->next_block;
+        if (aligned->next_block) {
+            aligned->next_block->prev_block = aligned;
         }
+        block->next_block = aligned;
+        block->size = gap - META_SIZE;
+        block->flag = freeBlock;
+        merge_(block);
     }
-    
-    // Adjust the program break if necessary
-    while ((PBR_STEP < (prev_node->size)) && (prev_node->flag)) {
-        // Decrease the program break to release excess memory
-        sbrk(-PBR_STEP);
-        num_block -= 1;
-        // Update the size of the last block in the heap
-        prev_node->size -= PBR_STEP;
+    // Give the unused tail back as a free block, merged with the free block needed_block
+    // may have split off after it
+    if (aligned->size > size) {
+        split(aligned, size);
+        tail = aligned->next_block;
+        if (tail && (freeBlock == tail->flag) && tail->next_block && (freeBlock == tail->next_block->flag)) {
+            bin_remove(arena, tail);
+            merge_(tail);
+        }
+    }
+    arena->stats.heap_bytes += aligned->size;
+    arena_unlock(arena);
+    return (void *)(aligned + 1);
+}
+
+/*
+ * Returns the number of bytes that can be used in an allocated memory block, it backs
+ * the malloc_usable_size() entry point.
+ * 
+ * Parameters:
+ *  - ptr: Pointer to the allocated memory block.
+ * 
+ * Returns:
+ *  - The size of the slab object or of the block payload, at least the size requested.
+ *  - 0 if 'ptr' is NULL.
+ */
+size_t my_malloc_usable_size(void *ptr) {
+    if (NULL == ptr) {
+        return 0;
+    }
+    if (is_slab(ptr)) {
+        return SLAB_OF(ptr)->object_size;
+    }
+    return (((struct meta_data *)ptr) - 1)->size;
+}
+
+/*
+ * Changes a tunable of the allocator, it backs the mallopt() entry point.
+ * 
+ * Only M_MMAP_THRESHOLD is supported: requests of 'value' bytes or more get a
+ * mapping of their own. Values above CHUNK_BLOCK_SIZE are lowered to it.
+ * 
+ * Parameters:
+ *  - param: The tunable to change.
+ *  - value: Its new value.
+ * 
+ * Returns:
+ *  - 1 if the tunable was changed.
+ *  - 0 if the tunable is not supported or the value is invalid.
+ */
+int my_mallopt(int param, int value) {
+    size_t threshold;
+
+    if ((param != M_MMAP_THRESHOLD) || (value < 0)) {
+        return 0;
+    }
+    threshold = value;
+    // Blocks bigger than a heap chunk can hold must always be mapped on their own
+    if (threshold > CHUNK_BLOCK_SIZE) {
+        threshold = CHUNK_BLOCK_SIZE;
+    }
+    __atomic_store_n(&mmap_threshold, threshold, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * Merges a free block with its free neighbours in memory.
+ * 
+ * This function uses the next and previous block pointers of 'block' to merge it
+ * with the blocks right after and right before it when they are free, so the cost
+ * does not depend on the size of the heap. The merged block is put in the bin of
+ * its size. Once the big free blocks of the arena hold more than PURGE_THRESHOLD bytes
+ * of pages that are backed by memory, those pages are given back to the OS with
+ * madvise(MADV_DONTNEED), at most once every PURGE_INTERVAL milliseconds unless they
+ * hold more than PURGE_LIMIT bytes. When the
+ * merged block covers its whole heap chunk and the
+ * arena already keeps MAX_FREE_CHUNKS empty chunks, the chunk is unmapped.
+ * The merged block stays zeroed only when all the merged blocks were, the headers and
+ * links that end up inside it are then cleared.
+ * The lock of the arena that owns the block must be held.
+ * 
+ * Parameters:
+ *  - block: Pointer to a free block that is not in any bin.
+ * 
+ * Returns:
+ *  - Pointer to the merged block.
+ *  - NULL if the block was unmapped with its heap chunk.
+ */
+struct meta_data *merge_(struct meta_data *block) {
+    struct heap_chunk *chunk = CHUNK_OF(block);
+    struct arena *arena = chunk->arena;
+    struct meta_data *next_node = block->next_block;
+    struct meta_data *prev_node = block->prev_block;
+
+    // Merge the next block into this one if it is free
+    if (next_node && (freeBlock == next_node->flag)) {
+        bin_remove(arena, next_node);
+        block->zeroed = block->zeroed && next_node->zeroed;
+        block->size += next_node->size + META_SIZE;
+        block->next_block = next_node->next_block;
+        if (block->next_block) {
+            block->next_block->prev_block = block;
+        }
+        if (block->zeroed) {
+            memset(next_node, 0, META_SIZE + MIN_BLOCK_SIZE);
+        }
+        arena->stats.merges++;
+    }
+    // Merge this block into the previous one if it is free
+    if (prev_node && (freeBlock == prev_node->flag)) {
+        bin_remove(arena, prev_node);
+        prev_node->zeroed = prev_node->zeroed && block->zeroed;
+        prev_node->size += block->size + META_SIZE;
+        prev_node->next_block = block->next_block;
+        if (prev_node->next_block) {
+            prev_node->next_block->prev_block = prev_node;
+        }
+        if (prev_node->zeroed) {
+            memset(block, 0, META_SIZE + MIN_BLOCK_SIZE);
+        }
+        block = prev_node;
+        arena->stats.merges++;
     }
+
+    // The merged block covers its whole chunk
+    if ((NULL == block->prev_block) && (NULL == block->next_block)) {
+        // Keep a few empty chunks per arena so a busy arena does not map and unmap in a loop
+        if (arena->free_chunks >= MAX_FREE_CHUNKS) {
+            os_munmap(chunk, chunk->size);
+            __atomic_fetch_sub(&num_block, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        arena->free_chunks++;
+    }
+    bin_insert(arena, block);
+    // Give the pages of the big free blocks back to the OS once they hold too much memory
+    if (purge_due(arena)) {
+        arena_purge(arena);
+    }
+    return block;
 }
 
 /*
@@ -504,34 +2259,196 @@ void split(struct meta_data *fit_block, size_t size) {
     // Calculate the pointer to the new block after the split
     struct meta_data *new_block = (struct meta_data *)((void *)fit_block + size + META_SIZE);
     
-    // Check if the remaining space after splitting is large enough to hold metadata
-    if ((fit_block->size - size) > META_SIZE) {
+    // Check if the remaining space after splitting is large enough to hold a free block
+    if ((fit_block->size - size) >= META_SIZE + MIN_BLOCK_SIZE) {
         // Create a new free block with the remaining space
         new_block->size = (fit_block->size) - size - META_SIZE;
         new_block->flag = freeBlock;
+        // The new header is written past the links of fit_block, the rest of its payload is unchanged
+        new_block->zeroed = fit_block->zeroed;
         new_block->next_block = fit_block->next_block;
+        new_block->prev_block = fit_block;
+        bin_insert(CHUNK_OF(fit_block)->arena, new_block);
+        CHUNK_OF(fit_block)->arena->stats.splits++;
+        if (new_block->next_block) {
+            new_block->next_block->prev_block = new_block;
+        }
         
         // Update the fit_block metadata to represent the first block after splitting
         fit_block->next_block = new_block;
         fit_block->size = size;
         fit_block->flag = busyBlock;
     } else {
-        // If the remaining space is not large enough to hold metadata, do not split
-        fit_block->size = size;
+        // If the remaining space is not large enough to be a block, do not split
+        // and keep the whole size so the heap layout stays consistent
     }
 }
 
-void display_free_list(struct meta_data *ptr){
-    char i=0;
-    printf("current\t\t\t   size\t\t flag\t\t next\t\t numberBlocks\t\t progbreak \t\t \n");
-    printf("\n");
-    while(ptr){
-        printf("[%i]=%10p , %10ld , %10i ,    %10p ,   %10i,              %10p\n"
-                ,i,ptr+1,ptr->size,ptr->flag,(ptr->next_block)+1,num_block,ProgBreak);
-        
-        ptr=ptr->next_block;
-        i++;
-    };
-    printf("------------------------------------\n");
+/*
+ * Reads the statistics of the allocator.
+ * 
+ * The counters of every arena are added up under its lock, the counters of the calls
+ * to the OS are read without any lock. Nothing is walked, so it is cheap enough to be
+ * called periodically by a running process.
+ * 
+ * Parameters:
+ *  - stats: Filled with the statistics.
+ * 
+ * Returns:
+ *  - None
+ */
+void hmm_stats(struct hmm_stats *stats) {
+    unsigned int count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    struct arena *arena;
+    unsigned int i;
+    unsigned int k;
+
+    memset(stats, 0, sizeof(*stats));
+    // The first arena is used before init_fun has run
+    if (0 == count) {
+        count = 1;
+    }
+    for (i = 0; i < count; i++) {
+        arena = &arenas[i];
+        arena_lock(arena);
+        stats->heap_bytes += arena->stats.heap_bytes;
+        for (k = 0; k < SLAB_CLASSES; k++) {
+            stats->slab_objects[k] += arena->stats.slab_objects[k];
+        }
+        stats->merges += arena->stats.merges;
+        stats->splits += arena->stats.splits;
+        arena_unlock(arena);
+    }
+    for (k = 0; k < SLAB_CLASSES; k++) {
+        stats->slab_class_size[k] = slab_sizes[k];
+    }
+    pthread_mutex_lock(&slab_region_lock);
+    if (slab_size) {
+        stats->slab_pages = (slab_top - (char *)slab_base) / SLAB_PAGE_SIZE - slab_free_page_count;
+        stats->bytes_mapped = slab_committed - (char *)slab_base;
+    }
+    pthread_mutex_unlock(&slab_region_lock);
+
+    stats->heap_chunks = __atomic_load_n(&num_block, __ATOMIC_RELAXED);
+    stats->mmapped_blocks = __atomic_load_n(&mmapped_blocks, __ATOMIC_RELAXED);
+    stats->mmapped_bytes = __atomic_load_n(&mmapped_bytes, __ATOMIC_RELAXED);
+    stats->bytes_mapped += stats->heap_chunks * HEAP_CHUNK_SIZE
+                           + stats->mmapped_bytes + stats->mmapped_blocks * META_SIZE;
+    stats->bytes_in_use = stats->heap_bytes + stats->mmapped_bytes;
+    for (k = 0; k < SLAB_CLASSES; k++) {
+        stats->bytes_in_use += stats->slab_objects[k] * stats->slab_class_size[k];
+    }
+    stats->mmap_calls = __atomic_load_n(&mmap_calls, __ATOMIC_RELAXED);
+    stats->munmap_calls = __atomic_load_n(&munmap_calls, __ATOMIC_RELAXED);
+    stats->mremap_calls = __atomic_load_n(&mremap_calls, __ATOMIC_RELAXED);
+    stats->madvise_calls = __atomic_load_n(&madvise_calls, __ATOMIC_RELAXED);
+    stats->mprotect_calls = __atomic_load_n(&mprotect_calls, __ATOMIC_RELAXED);
+    stats->double_frees = __atomic_load_n(&double_frees, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&prof_lock);
+    stats->prof_samples = prof_live_samples;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+ * Prints the statistics of the allocator on stderr, it backs the malloc_stats() entry point.
+ * 
+ * Parameters: None
+ * 
+ * Returns:
+ *  - None
+ */
+void my_malloc_stats(void) {
+    struct hmm_stats stats;
+    unsigned int k;
+
+    hmm_stats(&stats);
+    fprintf(stderr, "bytes in use     = %10zu\n", stats.bytes_in_use);
+    fprintf(stderr, "bytes mapped     = %10zu\n", stats.bytes_mapped);
+    fprintf(stderr, "heap chunks      = %10zu, %zu bytes in use\n", stats.heap_chunks, stats.heap_bytes);
+    fprintf(stderr, "slab pages       = %10zu\n", stats.slab_pages);
+    for (k = 0; k < SLAB_CLASSES; k++) {
+        if (stats.slab_objects[k]) {
+            fprintf(stderr, "  %3zu byte class = %10zu objects\n", stats.slab_class_size[k], stats.slab_objects[k]);
+        }
+    }
+    fprintf(stderr, "mmapped blocks   = %10zu, %zu bytes\n", stats.mmapped_blocks, stats.mmapped_bytes);
+    fprintf(stderr, "os calls         = mmap %llu, munmap %llu, mremap %llu, madvise %llu, mprotect %llu\n",
+            stats.mmap_calls, stats.munmap_calls, stats.mremap_calls, stats.madvise_calls, stats.mprotect_calls);
+    fprintf(stderr, "merges           = %10llu\n", stats.merges);
+    fprintf(stderr, "splits           = %10llu\n", stats.splits);
+    fprintf(stderr, "double frees     = %10llu\n", stats.double_frees);
+    if (prof_rate) {
+        fprintf(stderr, "heap samples     = %10llu\n", stats.prof_samples);
+    }
 }
 
+/*
+ * Writes the sampled allocations that are still allocated to the heap profile file.
+ * 
+ * Every sample is written on one line as its size followed by the return addresses of
+ * its call stack, which addr2line turns into source lines. Only async-signal-safe
+ * functions are used, so it is also the handler of PROF_SIGNAL.
+ * 
+ * Parameters: None
+ * 
+ * Returns:
+ *  - None
+ */
+void hmm_prof_dump(void) {
+    char line[64 + PROF_MAX_DEPTH * 20];
+    size_t length;
+    size_t walked;
+    size_t total;
+    struct prof_sample *sample;
+    unsigned int bucket;
+    unsigned int i;
+    int fd;
+
+    if (0 == prof_rate) {
+        return;
+    }
+    // The file is prof_file.<pid>
+    length = strlen(prof_file);
+    if (length > sizeof(line) - 32) {
+        return;
+    }
+    memcpy(line, prof_file, length);
+    line[length++] = '.';
+    length += prof_format(line + length, getpid(), 10);
+    line[length] = '\0';
+    fd = open(line, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    memcpy(line, "heap profile: one sample every ", 31);
+    length = 31 + prof_format(line + 31, prof_rate, 10);
+    memcpy(line + length, " bytes\n", 7);
+    length += 7;
+    if (write(fd, line, length) < 0) {
+        close(fd);
+        return;
+    }
+
+    // Another thread may change the table meanwhile, a walk never takes more steps than there are samples
+    total = __atomic_load_n(&prof_sample_count, __ATOMIC_RELAXED);
+    for (bucket = 0; bucket < PROF_TABLE_SIZE; bucket++) {
+        walked = 0;
+        for (sample = __atomic_load_n(&prof_table[bucket], __ATOMIC_ACQUIRE);
+             sample && (walked < total); sample = sample->next, walked++) {
+            length = prof_format(line, sample->size, 10);
+            line[length++] = ' ';
+            line[length++] = '@';
+            for (i = 0; (i < sample->depth) && (i < PROF_MAX_DEPTH); i++) {
+                line[length++] = ' ';
+                line[length++] = '0';
+                line[length++] = 'x';
+                length += prof_format(line + length, (uintptr_t)sample->stack[i], 16);
+            }
+            line[length++] = '\n';
+            if (write(fd, line, length) < 0) {
+                break;
+            }
+        }
+    }
+    close(fd);
+}
@@ -1,51 +1,353 @@
 #ifndef HMM_H
+#define HMM_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for mremap */
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <malloc.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
 
   /* 
  * Structure representing metadata associated with each memory block.
- * Contains a pointer to the next block, the size of the block, and a flag
- * indicating whether the block is free or busy.
+ * Contains pointers to the next and previous blocks in memory, the size of the
+ * block, and a flag indicating whether the block is free or busy.
+ * The previous block pointer is the boundary tag that lets a freed block find
+ * its neighbour before it without walking the heap.
+ * The zeroed byte records that a free block, or a block just taken from one, still
+ * holds the zeros the OS gave, so my_calloc does not clear it again. The first
+ * MIN_BLOCK_SIZE bytes of the payload are left out since a free block keeps its
+ * links there.
  */
 struct meta_data {
     struct meta_data *next_block; // Pointer to the next block
+    struct meta_data *prev_block; // Pointer to the previous block
     size_t size;                  // Size of the block
     char flag;                    // Flag indicating freeBlock or busyBlock
+    char zeroed;                  // Non-zero if the payload after MIN_BLOCK_SIZE bytes reads as zeros
 };
 
 /* Macro defining the value used to indicate a free memory block. */
 #define freeBlock 1
 
-/* Macro defining the value used to indicate a busy (allocated) memory block. */
-#define busyBlock 0
+/*
+ * Macro defining the value used to indicate a busy (allocated) memory block.
+ * It is not 0, so the header of a block that was merged into a free neighbour and then
+ * cleared, or whose page was given back to the OS, is never taken for a busy block
+ * when the program frees it again.
+ */
+#define busyBlock 8
+
+/*
+ * Macro defining the value used to indicate a block that the program freed but that is
+ * waiting in the remote free list of its arena. Such a block is not merged with its
+ * neighbours and freeing it again is reported as a double free.
+ */
+#define cachedBlock 2
+
+/*
+ * Macro defining the value used to indicate a busy block that has its own mapping
+ * instead of living in a heap chunk. It is unmapped as soon as it is freed.
+ * The header of such a block is at the start of its mapping, except for blocks with
+ * a big alignment whose prev_block holds the start of the mapping instead.
+ */
+#define mmappedBlock 3
+
+/*
+ * Macro defining the bit added to the flag of a busyBlock or mmappedBlock that the heap
+ * profiler sampled. my_free clears it and forgets the sample before freeing the block.
+ */
+#define sampledBlock 4
+
+/*
+ * Macro defining the alignment of the memory returned by my_malloc, 8 bytes by default.
+ * Build with -DMALLOC_ALIGNMENT=16 to get the 16 bytes that SSE code and long double
+ * expect. Only 8 and 16 are supported: the heap chunk header and the block header are
+ * multiples of 16 bytes, so block payloads keep the alignment of block sizes.
+ * Bigger alignments are served by my_memalign.
+ */
+#ifndef MALLOC_ALIGNMENT
+#define MALLOC_ALIGNMENT 8
+#endif
+#if (MALLOC_ALIGNMENT != 8) && (MALLOC_ALIGNMENT != 16)
+#error "MALLOC_ALIGNMENT must be 8 or 16"
+#endif
+
+/* Macro rounding a size up to a power of two alignment. */
+#define ALIGN_UP(size, alignment) (((size) + (alignment) - 1) & ~((size_t)(alignment) - 1))
 
 /* Macro defining the size of the struct meta_data, used for metadata calculation. */
-#define META_SIZE sizeof(struct meta_data) /*16 bytes*/
+#define META_SIZE sizeof(struct meta_data) /*32 bytes*/
 
 /* Macro defining the size of a page in memory [4 kb], typically used for heap management. */
 #define PAGE_SIZE 4096
 
-/* 
- * Macro defining the size of the memory increment when expanding the heap.
- * It's often set to a multiple of the page size to improve memory allocation performance.
+/*
+ * Macro defining the size of a heap chunk, the unit in which an arena gets memory
+ * from the OS with mmap. Chunks are aligned to their size, so the chunk holding a
+ * block is found by clearing the low bits of the block address.
+ * Requests that do not fit in a chunk get a mapping of their own.
+ */
+#define HEAP_CHUNK_SIZE (4 * 1024 * 1024)
+
+/*
+ * Macro defining how big a free block must be before its pages are given back to the
+ * OS with madvise(MADV_DONTNEED), like the trim threshold of glibc.
+ * Smaller free blocks keep their pages so reusing them does not fault again.
+ */
+#define RELEASE_THRESHOLD (128 * 1024)
+
+/*
+ * Macros defining when an arena gives the pages of its big free blocks back to the OS.
+ * PURGE_THRESHOLD is how many bytes the free blocks of RELEASE_THRESHOLD or more may
+ * hold in pages that are still backed by memory. Past it, the pages of all those blocks
+ * are given back in one pass over the big bins, at most once every PURGE_INTERVAL
+ * milliseconds. Memory that is freed and soon allocated again does not stay in the bins,
+ * and memory that does is given back a bit later, so a program that frees and allocates
+ * in a loop does not fault its pages back on every call. Past PURGE_LIMIT bytes the
+ * pass runs at once, so memory freed in a burst is given back even when the program
+ * then stops calling the allocator.
+ */
+#define PURGE_THRESHOLD (2 * HEAP_CHUNK_SIZE)
+#define PURGE_LIMIT (2 * PURGE_THRESHOLD)
+#define PURGE_INTERVAL 1000
+
+/*
+ * Macro defining how many empty heap chunks an arena keeps mapped. The next empty
+ * chunk is unmapped, so a busy arena does not map and unmap chunks in a loop.
+ */
+#define MAX_FREE_CHUNKS 4
+
+/*
+ * Macro defining the default size from which a request gets a mapping of its own
+ * instead of a block of a heap chunk. Such blocks are unmapped as soon as they are
+ * freed and my_realloc resizes them with mremap, without copying.
+ * It can be changed with the HMM_MMAP_THRESHOLD environment variable or with
+ * mallopt(M_MMAP_THRESHOLD, bytes), and never goes above CHUNK_BLOCK_SIZE.
+ */
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+
+/* Macro defining the most arenas the allocator creates, threads share them round-robin. */
+#define MAX_ARENAS 64
+
+/* Macro defining how many arenas are created for every online CPU. */
+#define ARENAS_PER_CPU 4
+
+/*
+ * Free-list links of a free block.
+ * A free block is not used by the program, so its links to the neighbours in the
+ * same size bin are kept in its payload, right after the struct meta_data header.
+ */
+struct free_links {
+    struct meta_data *next_free;  // Next free block in the same bin
+    struct meta_data *prev_free;  // Previous free block in the same bin
+};
+
+/* Macro giving the free-list links stored in the payload of a free block. */
+#define FREE_LINKS(block) ((struct free_links *)((block) + 1))
+
+/* Macro defining the smallest payload of a block, it must be able to hold the free-list links. */
+#define MIN_BLOCK_SIZE sizeof(struct free_links)
+
+/*
+ * Macros defining the size bins of free blocks.
+ * Sizes below SMALL_BIN_LIMIT get one exact bin per 8 bytes, bigger sizes share
+ * log-spaced bins (LARGE_BIN_SPLIT bins for every power of two).
+ * A bitmap records which bins are non-empty so the next usable bin is found
+ * without walking the empty ones.
+ */
+#define SMALL_BIN_COUNT 64
+#define SMALL_BIN_LIMIT (SMALL_BIN_COUNT * 8)
+#define LARGE_BIN_SPLIT 4
+#define LARGE_BIN_COUNT 128
+#define NUM_BINS (SMALL_BIN_COUNT + LARGE_BIN_COUNT)
+#define BINMAP_WORDS (NUM_BINS / 64)
+
+/*
+ * Macros defining the slab layer for small sizes.
+ * Requests up to SLAB_MAX_SIZE bytes are rounded up to one of SLAB_CLASSES object
+ * sizes (every 16 bytes up to 128, every 32 bytes up to 256). Objects of one class
+ * are packed in slab pages of SLAB_PAGE_SIZE bytes without any header of their own,
+ * a bitmap in the header of the slab page records which objects are in use.
+ * All slab pages are carved from a single range of address space reserved by init_fun,
+ * so a pointer is known to be a slab object by comparing it with the bounds of that
+ * range, and its slab page is found by clearing the low bits of its address.
+ * The range is made writable SLAB_COMMIT_STEP bytes at a time as slab pages are needed.
+ */
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES 12
+#define SLAB_MIN_SIZE 16
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_SIZE / SLAB_MIN_SIZE / 64)
+#define SLAB_REGION_SIZE ((size_t)64 << (sizeof(void *) == 8 ? 30 : 20))
+#define SLAB_COMMIT_STEP (1024 * 1024)
+
+/*
+ * Structure representing the header at the start of every slab page.
+ * Bit i of the bitmap is set while object i of the page is allocated, the bits past
+ * the last object are always set.
+ */
+struct slab {
+    struct arena *arena;          // Arena that owns the slab page
+    struct slab *next_slab;       // Next slab page of the same class with free objects
+    struct slab *prev_slab;       // Previous slab page of the same class with free objects
+    unsigned int size_class;      // Size class of the objects
+    unsigned int object_size;     // Size of the objects
+    unsigned int capacity;        // Number of objects the page holds
+    unsigned int used;            // Number of allocated objects
+    unsigned int free_word;       // No bitmap word before this one has a free object
+    unsigned long long bitmap[SLAB_BITMAP_WORDS];
+};
+
+/* Macro defining where the objects of a slab page start, on a cache line boundary. */
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 63) & ~(size_t)63)
+
+/* Macro giving the slab page that holds a slab object. */
+#define SLAB_OF(ptr) ((struct slab *)((uintptr_t)(ptr) & ~((uintptr_t)SLAB_PAGE_SIZE - 1)))
+
+/*
+ * Macros defining the per-thread cache of slab objects.
+ * Every thread keeps up to TCACHE_MAX_COUNT freed objects of each slab class and
+ * serves allocations of those sizes without taking any lock.
+ * An empty cache list is refilled, and a full one is flushed, TCACHE_BATCH objects
+ * at a time under a single lock of the arena.
+ */
+#define TCACHE_CLASSES SLAB_CLASSES
+#define TCACHE_MAX_COUNT 32
+#define TCACHE_BATCH 16
+
+/*
+ * Structure representing the cache of slab objects of one thread.
+ * entries[i] chains the cached objects of size class i through their first word
+ * and counts[i] is the length of that chain. The second word of a cached object
+ * points to the cache, so my_free can tell when a cached object is freed again.
+ */
+struct tcache {
+    void *entries[TCACHE_CLASSES];
+    unsigned int counts[TCACHE_CLASSES];
+};
+
+/*
+ * Structure representing the counters of an arena.
+ * They are only changed under the arena lock, so counting costs no atomic operation.
+ * Objects held by thread caches count as allocated.
+ */
+struct arena_stats {
+    size_t heap_bytes;                   // payload bytes of the busy blocks of the heap chunks
+    size_t slab_objects[SLAB_CLASSES];   // allocated objects of every slab class
+    unsigned long long merges;           // free blocks merged with a free neighbour
+    unsigned long long splits;           // free blocks split to serve a smaller request
+};
+
+/*
+ * Structure representing an arena, an independent heap with its own lock.
+ * Threads are spread over the arenas so they rarely wait for each other. A block
+ * always goes back to the arena it came from, whichever thread frees it.
+ */
+struct arena {
+    pthread_mutex_t lock;                     // protects every other field and the chunks of the arena
+    struct meta_data *bins[NUM_BINS];         // heads of the free blocks of every size bin
+    unsigned long long bin_map[BINMAP_WORDS]; // bit i is set when bins[i] is not empty
+    void *remote_free;                        // memory freed while the lock was busy, pushed without the lock
+    unsigned int free_chunks;                 // chunks of the arena that hold a single free block
+    size_t dirty_bytes;                       // bytes of the binned free blocks that release_pages may give back
+    size_t purge_floor;                       // dirty_bytes the last arena_purge could not give back
+    unsigned long long purge_time;            // time of the last arena_purge, in milliseconds
+    struct slab *slabs[SLAB_CLASSES];         // slab pages of every class that have free objects
+    struct arena_stats stats;                 // counters read by hmm_stats
+};
+
+/*
+ * Structure representing the header at the start of every heap chunk.
+ * The blocks of the chunk follow it, linked by their next and previous block pointers.
+ */
+struct heap_chunk {
+    struct arena *arena;  // Arena that owns the chunk
+    size_t size;          // Size of the mapping
+};
+
+/* Macro giving the heap chunk that holds a block of a heap chunk. */
+#define CHUNK_OF(block) ((struct heap_chunk *)((uintptr_t)(block) & ~((uintptr_t)HEAP_CHUNK_SIZE - 1)))
+
+/* Macro defining the payload size of the single free block of an empty heap chunk. */
+#define CHUNK_BLOCK_SIZE (HEAP_CHUNK_SIZE - sizeof(struct heap_chunk) - META_SIZE)
+
+/*
+ * Structure representing the statistics of the allocator, filled by hmm_stats.
+ * Bytes count payloads as requested after alignment, headers are not included.
+ */
+struct hmm_stats {
+    size_t bytes_in_use;                         // bytes allocated by the program, thread caches included
+    size_t bytes_mapped;                         // bytes of heap chunks, writable slab pages and mmapped blocks
+    size_t heap_chunks;                          // mapped heap chunks
+    size_t heap_bytes;                           // bytes of the busy blocks of the heap chunks
+    size_t slab_pages;                           // slab pages in use
+    size_t slab_class_size[SLAB_CLASSES];        // object size of every slab class
+    size_t slab_objects[SLAB_CLASSES];           // allocated objects of every slab class
+    size_t mmapped_blocks;                       // blocks with a mapping of their own
+    size_t mmapped_bytes;                        // bytes of the blocks with a mapping of their own
+    unsigned long long mmap_calls;               // calls to mmap
+    unsigned long long munmap_calls;             // calls to munmap
+    unsigned long long mremap_calls;             // calls to mremap
+    unsigned long long madvise_calls;            // calls to madvise
+    unsigned long long mprotect_calls;           // calls to mprotect
+    unsigned long long merges;                   // free blocks merged with a free neighbour
+    unsigned long long splits;                   // free blocks split to serve a smaller request
+    unsigned long long double_frees;             // frees of memory that was already free
+    unsigned long long prof_samples;             // sampled allocations that are still allocated
+};
+
+/*
+ * Macros defining the sampling heap profiler.
+ * When the HMM_PROF_SAMPLE environment variable is set to N, about one allocation for
+ * every N bytes allocated records the call stack that made it. The stacks of the sampled
+ * allocations that are still allocated are written to HMM_PROF_FILE.<pid> (hmm_prof.<pid>
+ * by default) when the process gets PROF_SIGNAL, or when hmm_prof_dump is called.
+ * Sampled allocations are heap blocks flagged sampledBlock, even small ones.
+ */
+#define PROF_SIGNAL SIGUSR2
+#define PROF_MAX_DEPTH 32
+#define PROF_TABLE_SIZE 4096
+#define PROF_POOL_SIZE (64 * 1024)
+
+/*
+ * Structure representing a sampled allocation.
+ * Samples are never unmapped, a freed sample is kept for the next one, so the signal
+ * handler can read them while other threads allocate.
  */
-#define PBR_STEP PAGE_SIZE * 33
+struct prof_sample {
+    struct prof_sample *next;       // Next sample of the same table bucket, or of the free samples
+    void *ptr;                      // The sampled allocation
+    size_t size;                    // Its size
+    unsigned int depth;             // Number of frames of the stack
+    void *stack[PROF_MAX_DEPTH];    // Return addresses, innermost first
+};
 
 
 /*
  * Initializes the memory management system.
  * 
  * This function sets up the initial state of the memory management system by:
- * 1. Allocating memory for the initial free list using the sbrk system call.
- * 2. Determining the current program break and storing it in ProgBreak.
- * 3. Initializing the number of blocks to 1.
- * 4. Setting the flag of the first block in the free list to indicate it's free.
- * 5. Setting the next block pointer of the first block to NULL, indicating no further blocks yet.
- * 6. Setting the size of the first block in the free list based on the allocated memory size.
- * 7. Updating the tail pointer to point to the end of the allocated memory block.
+ * 1. Reading the page size of the system, used to release free pages.
+ * 2. Choosing the number of arenas from the number of online CPUs.
+ * 3. Reserving the address range of the slab pages. Only address space is reserved,
+ *    a smaller range is tried when the full SLAB_REGION_SIZE can not be reserved and
+ *    small requests use heap blocks when no range can be reserved at all.
+ * 4. Starting the heap profiler when HMM_PROF_SAMPLE is set, PROF_SIGNAL then writes
+ *    the profile to the file named by HMM_PROF_FILE.
+ * 5. Reading the mmap threshold from the HMM_MMAP_THRESHOLD environment variable.
+ * The arenas themselves get their first heap chunk when they are first used.
  * 
  * Parameters: None
  * 
@@ -55,50 +357,59 @@ void init_fun(void);
 /*
  * Finds a suitable free block for memory allocation or extends the heap if necessary.
  * 
- * This function traverses the linked list of free memory blocks to find a block 
- * that can accommodate the requested size. If such a block is found, it returns a 
- * pointer to that block. If not, it extends the heap by requesting additional memory 
- * using the sbrk system call and then initializes metadata for the newly allocated block.
+ * This function looks in the size bins of the arena for a free block that can accommodate
+ * the requested size. If such a block is found, it is unlinked from its bin and returned.
+ * If not, it extends the arena by mapping a new heap chunk with mmap and returns the
+ * free block that covers it. The arena lock must be held.
  * 
  * Parameters:
- *  - size: The size of memory requested for allocation.
+ *  - arena: The arena to allocate from.
+ *  - size: The size of memory requested for allocation, at most CHUNK_BLOCK_SIZE.
  * 
  * Returns:
  *  - Pointer to the suitable free block if found.
  *  - NULL if no suitable block is found or memory extended fails.
  */
-struct meta_data *find_free_block( size_t size);
+struct meta_data *find_free_block(struct arena *arena, size_t size);
 /*
  * Allocates a block of memory of the required size.
  * 
- * This function attempts to find a suitable free block of memory using the find_free_block
+ * This function first runs the purge of the arena when it is due and no free has run
+ * it, then attempts to find a suitable free block of memory using the find_free_block
  * function. If a suitable block is found, it marks the block as busy and checks if the 
  * block can be split to accommodate the requested size. If splitting is possible, it 
  * creates a new free block. Finally, it returns a pointer to the allocated block.
+ * The arena lock must be held.
  * 
  * Parameters:
+ *  - arena: The arena to allocate from.
  *  - size: The size of memory requested for allocation.
  * 
  * Returns:
  *  - Pointer to the allocated block if successful.
  *  - NULL if no suitable block is found or memory allocation fails.
  */
-struct meta_data *needed_block(size_t size);
+struct meta_data *needed_block(struct arena *arena, size_t size);
 /*
  * Allocates a block of memory of the required size using a custom memory management system.
  * 
- * This function first checks if the free list is NULL. If so, it initializes the memory management
- * system using the init_fun function. Then, it checks if the requested block size is negative.
- * If the size is valid, it adjusts the size to ensure proper alignment. Next, it calls the needed_block
- * function to find a suitable free block for allocation. If a block is successfully allocated,
- * it updates the program break and returns a pointer to the allocated memory block.
+ * This function first checks if the requested block size is negative, that is bigger than
+ * PTRDIFF_MAX as a negative int becomes once converted. If the size is valid, it adjusts the
+ * size to ensure proper alignment. Allocations picked by the heap profiler get a heap block
+ * marked sampledBlock. Sizes up to SLAB_MAX_SIZE get an object of a slab page, served from
+ * the cache of the calling thread without locking. Requests of mmap_threshold bytes or more
+ * get a mapping of their own.
+ * Otherwise, it takes the lock of the arena of the calling thread and calls the needed_block
+ * function to find a suitable free block for allocation, then returns a pointer to the
+ * allocated memory block.
  * 
  * Parameters:
  *  - block_size: The size of memory requested for allocation.
  * 
  * Returns:
  *  - Pointer to the allocated block if successful.
- *  - NULL if memory allocation fails or the requested block size is negative.
+ *  - NULL, with errno set to ENOMEM, if memory allocation fails or the requested block
+ *    size is negative.
  */
 void *my_malloc(size_t block_size);
 /*
@@ -107,8 +418,10 @@ void *my_malloc(size_t block_size);
  * This function allocates a block of memory large enough to fit 'num' elements,
  * each of size 'size' bytes. It checks for invalid input parameters and returns
  * NULL if 'num' or 'size' is zero, or if their product would result in an overflow.
- * Otherwise, it allocates the memory using my_malloc, initializes the memory block
- * with zeros using memset, and returns a pointer to the allocated memory.
+ * Otherwise, it allocates the memory using my_malloc and initializes the memory block
+ * with zeros using memset. A block marked zeroed still holds the zeros of the OS, so
+ * only its first MIN_BLOCK_SIZE bytes are cleared, which keeps untouched pages of big
+ * zero-initialized tables from being faulted in.
  * 
  * Parameters:
  *  - num: Number of elements.
@@ -116,7 +429,8 @@ void *my_malloc(size_t block_size);
  * 
  * Returns:
  *  - Pointer to the allocated and initialized memory block if successful.
- *  - NULL if memory allocation fails or the input parameters are invalid.
+ *  - NULL if 'num' or 'size' is zero.
+ *  - NULL, with errno set to ENOMEM, if the product overflows or memory allocation fails.
  */
 void *my_calloc(size_t num , size_t size);
 /*
@@ -125,11 +439,15 @@ void *my_calloc(size_t num , size_t size);
  * This function reallocates the memory block pointed to by 'ptr' to a new size specified
  * by 'new_size'. If 'ptr' is NULL, it behaves like malloc and allocates a new memory block.
  * If 'new_size' is zero, it deallocates the memory block pointed to by 'ptr' and behaves
- * like free. Otherwise, it attempts to resize the existing memory block. If resizing is
+ * like free. A slab object is kept when the new size fits its size class and moved
+ * otherwise. A block with a mapping of its own is resized with mremap, which lets the
+ * kernel move the pages instead of copying them. Otherwise, it attempts to resize the
+ * existing memory block. If resizing is
  * successful and the next block is free and large enough to accommodate the difference
  * in sizes, the function splits the next block and creates a new free block after resizing
  * the current block. If the next block is not free or is not large enough, the function
  * allocates a new memory block, copies the data from the old block, and frees the old block.
+ * The bytes past the old size are not cleared, like the memory returned by my_malloc.
  * 
  * Parameters:
  *  - ptr: Pointer to the previously allocated memory block.
@@ -144,9 +462,12 @@ void *my_realloc(void *ptr , size_t new_size);
  * Deallocates a previously allocated memory block.
  * 
  * This function deallocates the memory block pointed to by 'ptr'. If 'ptr' is NULL,
- * it does nothing. Otherwise, it traverses the free list to find the metadata corresponding
- * to the memory block pointed to by 'ptr'. If found, it marks the block as free and attempts
- * to merge adjacent free blocks to coalesce contiguous free memory blocks into larger ones.
+ * it does nothing. Slab objects, recognized by their address, are kept in the cache of the
+ * calling thread. Otherwise, it reads the metadata stored right before the memory block
+ * pointed to by 'ptr' and unmaps blocks with a mapping of their own. A double free is
+ * counted and reported once on stderr. Other blocks go back to the arena that owns
+ * their heap chunk, where they are marked as free and merged with their free neighbours,
+ * or left on the remote free list of the arena when another thread holds its lock.
  * 
  * Parameters:
  *  - ptr: Pointer to the previously allocated memory block.
@@ -156,20 +477,77 @@ void *my_realloc(void *ptr , size_t new_size);
  */
 void my_free (void *ptr);
 /*
- * Merges adjacent free blocks to coalesce contiguous free memory blocks into larger ones.
+ * Allocates a block of memory whose address is a multiple of 'alignment'.
  * 
- * This function traverses the free list to find adjacent free memory blocks. If it finds
- * two consecutive free blocks, it merges them into a single larger free block. It also
- * handles the case where the program break needs to be adjusted if the last block in the
- * heap becomes smaller than the page size.
+ * It backs memalign, posix_memalign, aligned_alloc, valloc and pvalloc. Alignments up to
+ * MALLOC_ALIGNMENT are served by my_malloc. Small requests with an alignment up to 64
+ * bytes get a slab object of a class whose objects are all aligned. Other requests get
+ * a heap block big enough to hold the aligned block and a free block before it, the
+ * free block is carved off and merged with its free neighbours, and the tail is split
+ * off like in needed_block. Big requests get a mapping of their own whose unused pages
+ * are unmapped. The result is freed, merged and resized like any other block.
  * 
  * Parameters:
- *  - None
+ *  - alignment: The alignment, a power of two.
+ *  - size: The size of memory requested for allocation.
  * 
  * Returns:
- *  - None
+ *  - Pointer to the allocated memory if successful.
+ *  - NULL, with errno set to EINVAL if 'alignment' is not a power of two, or to ENOMEM
+ *    if memory allocation fails.
+ */
+void *my_memalign(size_t alignment, size_t size);
+/*
+ * Returns the number of bytes that can be used in an allocated memory block, it backs
+ * the malloc_usable_size() entry point.
+ * 
+ * Parameters:
+ *  - ptr: Pointer to the allocated memory block.
+ * 
+ * Returns:
+ *  - The size of the slab object or of the block payload, at least the size requested.
+ *  - 0 if 'ptr' is NULL.
+ */
+size_t my_malloc_usable_size(void *ptr);
+/*
+ * Changes a tunable of the allocator, it backs the mallopt() entry point.
+ * 
+ * Only M_MMAP_THRESHOLD is supported: requests of 'value' bytes or more get a
+ * mapping of their own. Values above CHUNK_BLOCK_SIZE are lowered to it.
+ * 
+ * Parameters:
+ *  - param: The tunable to change.
+ *  - value: Its new value.
+ * 
+ * Returns:
+ *  - 1 if the tunable was changed.
+ *  - 0 if the tunable is not supported or the value is invalid.
+ */
+int my_mallopt(int param, int value);
+/*
+ * Merges a free block with its free neighbours in memory.
+ * 
+ * This function uses the next and previous block pointers of 'block' to merge it
+ * with the blocks right after and right before it when they are free, so the cost
+ * does not depend on the size of the heap. The merged block is put in the bin of
+ * its size. Once the big free blocks of the arena hold more than PURGE_THRESHOLD bytes
+ * of pages that are backed by memory, those pages are given back to the OS with
+ * madvise(MADV_DONTNEED), at most once every PURGE_INTERVAL milliseconds unless they
+ * hold more than PURGE_LIMIT bytes. When the
+ * merged block covers its whole heap chunk and the
+ * arena already keeps MAX_FREE_CHUNKS empty chunks, the chunk is unmapped.
+ * The merged block stays zeroed only when all the merged blocks were, the headers and
+ * links that end up inside it are then cleared.
+ * The lock of the arena that owns the block must be held.
+ * 
+ * Parameters:
+ *  - block: Pointer to a free block that is not in any bin.
+ * 
+ * Returns:
+ *  - Pointer to the merged block.
+ *  - NULL if the block was unmapped with its heap chunk.
  */
-void merge_(void);
+struct meta_data *merge_(struct meta_data *block);
 /*
  * Splits a free memory block into two blocks.
  * 
@@ -187,8 +565,42 @@ void merge_(void);
  */
 void split(struct meta_data *fit_block , size_t size);
 
-void display_free_list(struct meta_data *ptr);
-//void freg_freed(unsigned int freg);
+/*
+ * Reads the statistics of the allocator.
+ * 
+ * The counters of every arena are added up under its lock, the counters of the calls
+ * to the OS are read without any lock. Nothing is walked, so it is cheap enough to be
+ * called periodically by a running process.
+ * 
+ * Parameters:
+ *  - stats: Filled with the statistics.
+ * 
+ * Returns:
+ *  - None
+ */
+void hmm_stats(struct hmm_stats *stats);
+/*
+ * Prints the statistics of the allocator on stderr, it backs the malloc_stats() entry point.
+ * 
+ * Parameters: None
+ * 
+ * Returns:
+ *  - None
+ */
+void my_malloc_stats(void);
+/*
+ * Writes the sampled allocations that are still allocated to the heap profile file.
+ * 
+ * Every sample is written on one line as its size followed by the return addresses of
+ * its call stack, which addr2line turns into source lines. Only async-signal-safe
+ * functions are used, so it is also the handler of PROF_SIGNAL.
+ * 
+ * Parameters: None
+ * 
+ * Returns:
+ *  - None
+ */
+void hmm_prof_dump(void);
 
 
 
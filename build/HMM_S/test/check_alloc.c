@@ -0,0 +1,453 @@
+/*
+ * Allocator correctness checks.
+ *
+ * Calls the standard allocation functions and checks what they promise: the alignment
+ * of the aligned family and its EINVAL and ENOMEM cases, malloc_usable_size(), zeroed
+ * calloc memory and its overflow checks, and the reporting of double frees. Every
+ * failed check prints a line, the exit status is 1 when any check failed.
+ *
+ * It only calls the standard allocation functions, so it checks whatever allocator
+ * is in use:
+ *   gcc -O2 -o check_alloc check_alloc.c
+ *   ./check_alloc                                  (system allocator)
+ *   LD_PRELOAD=../../BUILD/libhmm.so ./check_alloc    (libhmm)
+ */
+#include <errno.h>
+#include <malloc.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Counts a failed check and prints where it failed. */
+#define CHECK(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            failures++; \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+        } \
+    } while (0)
+
+/* Sizes asked from every allocation function, from slab objects to own mappings. */
+static const size_t sizes[] = { 0, 1, 8, 15, 16, 24, 100, 256, 257, 1000, 4096, 5000, 100000, 300000 };
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+static int failures;
+
+/*
+ * Blocks are stored here before they are freed, so the compiler can not drop a pair
+ * of malloc and free calls whose memory looks unused.
+ */
+static void *volatile sink;
+
+/*
+ * free() called through a pointer the compiler can not see through, so a block that
+ * is written and freed, or freed twice, is freed exactly as the code says.
+ */
+static void (*volatile release)(void *) = free;
+
+/*
+ * Fills a block with a byte pattern derived from 'seed'.
+ */
+static void fill(unsigned char *ptr, size_t size, unsigned int seed) {
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        ptr[i] = (unsigned char)(seed + i * 7);
+    }
+}
+
+/*
+ * Tells whether a block still holds the pattern written by fill().
+ */
+static int holds(const unsigned char *ptr, size_t size, unsigned int seed) {
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        if (ptr[i] != (unsigned char)(seed + i * 7)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Checks one block returned by an aligned allocation function, then resizes and
+ * frees it.
+ */
+static void check_aligned_block(const char *name, void *ptr, size_t alignment, size_t size) {
+    CHECK(ptr != NULL, "%s(%zu, %zu) failed", name, alignment, size);
+    if (NULL == ptr) {
+        return;
+    }
+    CHECK(0 == (uintptr_t)ptr % alignment, "%s(%zu, %zu) returned %p", name, alignment, size, ptr);
+    CHECK(malloc_usable_size(ptr) >= size, "%s(%zu, %zu): usable size %zu", name, alignment, size,
+          malloc_usable_size(ptr));
+    fill(ptr, size, (unsigned int)alignment);
+    // An aligned block is resized like any other block
+    sink = ptr = realloc(ptr, size * 2 + 64);
+    CHECK(ptr && holds(ptr, size, (unsigned int)alignment), "%s(%zu, %zu): realloc lost the data",
+          name, alignment, size);
+    free(ptr);
+}
+
+/*
+ * Checks memalign, posix_memalign, aligned_alloc, valloc and pvalloc with every
+ * power-of-two alignment up to 1 MiB.
+ */
+static void check_aligned(void) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t alignment;
+    size_t size;
+    size_t i;
+    void *ptr;
+
+    for (alignment = sizeof(void *); alignment <= 1024 * 1024; alignment *= 2) {
+        for (i = 0; i < SIZE_COUNT; i++) {
+            check_aligned_block("memalign", memalign(alignment, sizes[i]), alignment, sizes[i]);
+            ptr = NULL;
+            CHECK(0 == posix_memalign(&ptr, alignment, sizes[i]), "posix_memalign(%zu, %zu) failed",
+                  alignment, sizes[i]);
+            check_aligned_block("posix_memalign", ptr, alignment, sizes[i]);
+            // C11 wants a size that is a multiple of the alignment
+            size = (sizes[i] + alignment - 1) / alignment * alignment;
+            check_aligned_block("aligned_alloc", aligned_alloc(alignment, size), alignment, size);
+        }
+    }
+    for (i = 0; i < SIZE_COUNT; i++) {
+        check_aligned_block("valloc", valloc(sizes[i]), page, sizes[i]);
+        check_aligned_block("pvalloc", pvalloc(sizes[i]), page, sizes[i]);
+    }
+
+    // Alignments that are not a power of two, or not a multiple of sizeof(void *)
+    ptr = &ptr;
+    CHECK(EINVAL == posix_memalign(&ptr, 3 * sizeof(void *), 100), "posix_memalign(24, 100) did not fail");
+    CHECK(EINVAL == posix_memalign(&ptr, sizeof(void *) / 2, 100), "posix_memalign(4, 100) did not fail");
+    CHECK(EINVAL == posix_memalign(&ptr, 0, 100), "posix_memalign(0, 100) did not fail");
+    CHECK(ptr == &ptr, "posix_memalign changed the pointer of a failed call");
+    // aligned_alloc either fails or rounds such an alignment up, like memalign does
+    errno = 0;
+    sink = ptr = aligned_alloc(48, 96);
+    CHECK(ptr ? (0 == (uintptr_t)ptr % 64) : (EINVAL == errno), "aligned_alloc(48, 96) returned %p", ptr);
+    free(ptr);
+    sink = ptr = memalign(48, 100);
+    CHECK(ptr && (0 == (uintptr_t)ptr % 64), "memalign(48, 100) returned %p", ptr);
+    free(ptr);
+
+    // Sizes that can not be allocated
+    CHECK(ENOMEM == posix_memalign(&ptr, 64, SIZE_MAX - 16), "posix_memalign(64, SIZE_MAX - 16) did not fail");
+    errno = 0;
+    sink = ptr = memalign(64, SIZE_MAX / 2);
+    CHECK((NULL == ptr) && (ENOMEM == errno), "memalign(64, SIZE_MAX / 2) did not fail with ENOMEM");
+}
+
+/*
+ * Checks that malloc_usable_size() covers the size asked from malloc and realloc.
+ */
+static void check_usable_size(void) {
+    size_t size;
+    void *ptr;
+
+    CHECK(0 == malloc_usable_size(NULL), "malloc_usable_size(NULL) is not 0");
+    for (size = 0; size <= 5000; size++) {
+        sink = ptr = malloc(size);
+        CHECK(ptr && (malloc_usable_size(ptr) >= size), "malloc(%zu): usable size %zu", size,
+              ptr ? malloc_usable_size(ptr) : 0);
+        // The whole usable size can be written
+        if (ptr) {
+            memset(ptr, 0xa5, malloc_usable_size(ptr));
+        }
+        sink = ptr = realloc(ptr, size * 3 + 1);
+        CHECK(ptr && (malloc_usable_size(ptr) >= size * 3 + 1), "realloc(%zu): usable size %zu",
+              size * 3 + 1, ptr ? malloc_usable_size(ptr) : 0);
+        free(ptr);
+    }
+    for (size = 64 * 1024; size <= 4 * 1024 * 1024; size *= 2) {
+        sink = ptr = malloc(size + 1);
+        CHECK(ptr && (malloc_usable_size(ptr) >= size + 1), "malloc(%zu): usable size %zu", size + 1,
+              ptr ? malloc_usable_size(ptr) : 0);
+        free(ptr);
+    }
+}
+
+/*
+ * Tells whether a block reads as zeros.
+ */
+static int zeroed(const unsigned char *ptr, size_t size) {
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        if (ptr[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Returns a block from calloc, after checking that it reads as zeros.
+ */
+static void *checked_calloc(size_t size, const char *after) {
+    unsigned char *ptr = calloc(1, size);
+
+    // A zero size may give NULL
+    CHECK((ptr || !size) && (!ptr || zeroed(ptr, size)), "calloc(1, %zu) after %s is not zeroed", size,
+          after);
+    return ptr;
+}
+
+/*
+ * Frees more than 20 MB in big dirty blocks and asks them back with calloc, libhmm
+ * gives the pages of free blocks back to the OS in between.
+ */
+static void calloc_after_purge(const char *after) {
+    static void *blocks[240];
+    size_t i;
+
+    for (i = 0; i < 240; i++) {
+        blocks[i] = malloc(100000);
+        memset(blocks[i], 0xa5, 100000);
+    }
+    for (i = 0; i < 240; i++) {
+        if (i % 10) {
+            release(blocks[i]);
+        }
+    }
+    for (i = 0; i < 240; i++) {
+        if (i % 10) {
+            blocks[i] = checked_calloc(100000, after);
+        }
+    }
+    for (i = 0; i < 240; i++) {
+        free(blocks[i]);
+    }
+}
+
+/*
+ * Checks calloc memory after a purge while every page of the process is locked, the
+ * pages then keep their contents because madvise fails on them. It runs in a child
+ * process so the rest of the checks do not run locked.
+ */
+static void check_calloc_locked(void) {
+    struct rlimit limit;
+    int before = failures;
+    int status;
+    pid_t pid;
+
+    // Without the right to lock that much memory every allocation would fail
+    if ((geteuid() != 0) && (getrlimit(RLIMIT_MEMLOCK, &limit) || (limit.rlim_cur < 256 * 1024 * 1024))) {
+        return;
+    }
+    fflush(NULL);
+    pid = fork();
+    if (0 == pid) {
+        if (0 == mlockall(MCL_CURRENT | MCL_FUTURE)) {
+            calloc_after_purge("a purge of locked pages");
+        }
+        _exit(failures != before);
+    }
+    CHECK((pid > 0) && (waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && (0 == WEXITSTATUS(status)),
+          "calloc after a purge of locked pages failed");
+}
+
+/*
+ * Checks that calloc memory reads as zeros however the block was used before: reused
+ * as it was freed, merged with its neighbours, split from a bigger block, or given
+ * back to the OS while it was free.
+ */
+static void check_calloc(void) {
+    static void *blocks[160];
+    size_t alignment;
+    // Kept out of sight of the compiler, which warns about calls it sees overflow
+    volatile size_t half = SIZE_MAX / 2 + 1;
+    volatile size_t root = (size_t)1 << (sizeof(size_t) * 4 + 1);
+    size_t size;
+    size_t i;
+    unsigned int r = 1;
+    void *ptr;
+
+    // Reuse: dirty blocks are freed and asked back with calloc
+    for (i = 0; i < SIZE_COUNT; i++) {
+        sink = ptr = malloc(sizes[i]);
+        memset(ptr, 0xa5, sizes[i]);
+        release(ptr);
+        free(checked_calloc(sizes[i], "reuse"));
+    }
+
+    // Merge: calloc blocks are freed next to dirty ones, the merged block is asked back
+    for (size = 1000; size <= 100000; size *= 10) {
+        for (i = 0; i < 8; i++) {
+            blocks[i] = (i % 2) ? checked_calloc(size, "a fresh block") : malloc(size);
+            memset(blocks[i], 0xa5, (i % 2) ? 16 : size);
+        }
+        for (i = 0; i < 8; i++) {
+            release(blocks[i]);
+        }
+        free(checked_calloc(size * 6, "merge"));
+    }
+
+    // Split: a big dirty block is freed and asked back in smaller pieces
+    sink = ptr = malloc(1000000);
+    memset(ptr, 0xa5, 1000000);
+    release(ptr);
+    for (i = 0; i < 40; i++) {
+        blocks[i] = checked_calloc(300 + i * 997, "split");
+    }
+    for (i = 0; i < 40; i++) {
+        free(blocks[i]);
+    }
+
+    calloc_after_purge("a purge");
+    check_calloc_locked();
+
+    // Aligned blocks cut out of a dirty free block that fits them exactly, with busy
+    // blocks on both sides, leave free blocks that calloc blocks come out of
+    for (alignment = 4096; alignment <= 64 * 1024; alignment *= 2) {
+        blocks[0] = malloc(1000);
+        sink = ptr = malloc(1008 + alignment + 48);
+        memset(ptr, 0xa5, 1008 + alignment + 48);
+        blocks[1] = malloc(1000);
+        release(ptr);
+        blocks[2] = memalign(alignment, 1000);
+        for (i = 3; i < 11; i++) {
+            blocks[i] = checked_calloc(300 + (i - 3) * 500, "an aligned split");
+        }
+        for (i = 0; i < 11; i++) {
+            free(blocks[i]);
+        }
+    }
+
+    // Random mix of malloc, calloc and free
+    memset(blocks, 0, sizeof(blocks));
+    for (i = 0; i < 100000; i++) {
+        r = r * 1103515245 + 12345;
+        ptr = blocks[(r >> 8) % 160];
+        if (ptr) {
+            release(ptr);
+            blocks[(r >> 8) % 160] = NULL;
+            continue;
+        }
+        size = (r >> 16) % 20000;
+        if (r & 1) {
+            ptr = checked_calloc(size, "random use");
+        } else {
+            sink = ptr = malloc(size);
+            memset(ptr, 0xa5, size);
+        }
+        blocks[(r >> 8) % 160] = ptr;
+    }
+    for (i = 0; i < 160; i++) {
+        free(blocks[i]);
+    }
+
+    // Sizes whose product overflows
+    errno = 0;
+    sink = ptr = calloc(half, 2);
+    CHECK((NULL == ptr) && (ENOMEM == errno), "calloc(SIZE_MAX / 2 + 1, 2) did not fail with ENOMEM");
+    errno = 0;
+    sink = ptr = calloc(root, root);
+    CHECK((NULL == ptr) && (ENOMEM == errno), "calloc(%zu, %zu) did not fail with ENOMEM", root, root);
+}
+
+/*
+ * Frees a small block twice.
+ */
+static void double_free_small(void) {
+    void *ptr = malloc(24);
+
+    release(ptr);
+    release(ptr);
+}
+
+/*
+ * Frees a heap block twice after it was merged with its free neighbour before it, and
+ * after enough memory was freed for the allocator to give pages back to the OS.
+ */
+static void double_free_merged(void) {
+    static void *blocks[240];
+    char *first = malloc(100000);
+    char *second = malloc(100000);
+    char *guard = malloc(1000);
+    int i;
+
+    for (i = 0; i < 240; i++) {
+        blocks[i] = malloc(100000);
+        memset(blocks[i], 1, 100000);
+    }
+    memset(first, 1, 100000);
+    memset(second, 1, 100000);
+    memset(guard, 1, 1000);
+    release(second);
+    release(first);
+    // Free more than 20 MB in big free blocks, every tenth block is kept so no chunk
+    // becomes empty and gets unmapped instead
+    for (i = 0; i < 240; i++) {
+        if (i % 10) {
+            release(blocks[i]);
+        }
+    }
+    release(second);
+}
+
+/*
+ * Runs a function that frees a block twice in a child process.
+ *
+ * Returns:
+ *  - 1 if the double free was reported, the child then wrote on stderr or was killed
+ *    by a signal like the abort() of the system allocator.
+ *  - 0 otherwise.
+ */
+static int double_free_reported(void (*run)(void)) {
+    int fds[2];
+    int status;
+    char byte;
+    ssize_t got;
+    pid_t pid;
+
+    if (pipe(fds)) {
+        return 0;
+    }
+    fflush(NULL);
+    pid = fork();
+    if (0 == pid) {
+        dup2(fds[1], STDERR_FILENO);
+        signal(SIGABRT, SIG_DFL);
+        run();
+        _exit(0);
+    }
+    close(fds[1]);
+    got = read(fds[0], &byte, 1);
+    close(fds[0]);
+    if ((pid < 0) || (waitpid(pid, &status, 0) != pid)) {
+        return 0;
+    }
+    return (got > 0) || WIFSIGNALED(status);
+}
+
+/*
+ * Checks that double frees are reported.
+ */
+static void check_double_free(void) {
+    CHECK(double_free_reported(double_free_small), "double free of a small block not reported");
+    CHECK(double_free_reported(double_free_merged), "double free of a merged block not reported");
+}
+
+int main(void) {
+    check_aligned();
+    check_usable_size();
+    check_calloc();
+    check_double_free();
+    if (failures) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}